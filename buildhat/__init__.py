@@ -8,6 +8,7 @@ from .force import ForceSensor
 from .hat import Hat
 from .light import Light
 from .matrix import Matrix
-from .motors import Motor, MotorPair, PassiveMotor
-from .serinterface import BuildHAT
+from .motors import Motor, MotorGroup, MotorPair, PassiveMotor, PidMode
+from .sampling import SampleGroup
+from .serinterface import BuildHAT, CallbackPolicy, MotorQueuePolicy
 from .wedo import MotionSensor, TiltSensor
@@ -0,0 +1,122 @@
+"""Capture of timestamped device data at the full data rate"""
+
+from array import array
+from threading import Condition
+
+
+class SampleRing:
+    """Fixed capacity ring buffer of timestamped samples
+
+    Each sample is stored as a row of doubles: the time.monotonic() it was
+    received, followed by the values from the device. The storage is
+    allocated once, when the first sample shows how many values a row
+    holds, and is filled directly by the serial reader thread.
+
+    Blocks are returned as array('d') of consecutive rows, which numpy can
+    use without copying, for example
+    ``numpy.frombuffer(block, dtype=numpy.float64).reshape(-1, ring.width + 1)``
+
+    :param capacity: Number of samples held before the oldest are overwritten
+    """
+
+    def __init__(self, capacity):
+        """Initialise ring buffer
+
+        :param capacity: Number of samples held before the oldest are overwritten
+        """
+        if not isinstance(capacity, int) or capacity <= 0:
+            raise ValueError("Capacity must be a positive integer")
+        self.capacity = capacity
+        self.width = None
+        self.overruns = 0
+        self._buf = None
+        self._stride = 0
+        self._head = 0
+        self._tail = 0
+        self._wanted = 0
+        self._cond = Condition()
+
+    def reset(self):
+        """Discard all samples, allowing the number of values per sample to change"""
+        with self._cond:
+            self.width = None
+            self._buf = None
+            self._head = 0
+            self._tail = 0
+
+    def __len__(self):
+        """Number of samples waiting to be read
+
+        :return: Number of samples
+        """
+        return self._head - self._tail
+
+    def append(self, timestamp, values):
+        """Add a sample, overwriting the oldest when full
+
+        :param timestamp: Time the sample was received
+        :param values: List of values from the device
+        """
+        with self._cond:
+            if self._buf is None:
+                self.width = len(values)
+                self._stride = self.width + 1
+                self._buf = array('d', bytes(8 * self._stride * self.capacity))
+            buf = self._buf
+            i = (self._head % self.capacity) * self._stride
+            buf[i] = timestamp
+            for v in values[:self.width]:
+                i += 1
+                buf[i] = v
+            self._head += 1
+            if self._head - self._tail > self.capacity:
+                self._tail = self._head - self.capacity
+                self.overruns += 1
+            if self._wanted and self._head - self._tail >= self._wanted:
+                self._cond.notify_all()
+
+    def _take(self, n):
+        """Remove the n oldest samples
+
+        :param n: Number of samples
+        :return: Block of rows
+        """
+        if n == 0 or self._buf is None:
+            return array('d')
+        start = (self._tail % self.capacity) * self._stride
+        end = start + n * self._stride
+        size = self.capacity * self._stride
+        if end <= size:
+            block = self._buf[start:end]
+        else:
+            block = self._buf[start:size] + self._buf[:end - size]
+        self._tail += n
+        return block
+
+    def drain(self):
+        """Remove all samples waiting to be read
+
+        :return: Block of rows, oldest first
+        :rtype: array.array
+        """
+        with self._cond:
+            return self._take(self._head - self._tail)
+
+    def wait(self, n, timeout=None):
+        """Wait for n samples, then remove them
+
+        :param n: Number of samples, up to the capacity
+        :param timeout: Seconds to wait, or None to wait indefinitely
+        :return: Block of rows, oldest first, or None if timed out
+        :rtype: array.array
+        """
+        if n > self.capacity:
+            raise ValueError("Cannot wait for more samples than the capacity")
+        with self._cond:
+            self._wanted = n
+            try:
+                if not self._cond.wait_for(lambda: self._head - self._tail >= n, timeout):
+                    return None
+            finally:
+                self._wanted = 0
+            return self._take(n)
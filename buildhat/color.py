@@ -1,30 +1,56 @@
 """Color sensor handling functionality"""
 
 import math
-from collections import deque
 from threading import Condition
 
 from .devices import Device
+from .palette import ColorPalette, RunningAverage
+from .serinterface import check_not_batching
 
 
 class ColorSensor(Device):
     """Color sensor
 
     :param port: Port of device
+    :param hat: Optional Hat the device is attached to, otherwise the first one
     :raises DeviceError: Occurs if there is no color sensor attached to port
     """
 
-    def __init__(self, port):
+    def __init__(self, port, hat=None):
         """
         Initialise color sensor
 
         :param port: Port of device
+        :param hat: Optional Hat the device is attached to, otherwise the first one
         """
-        super().__init__(port)
+        super().__init__(port, hat)
         self.reverse()
         self.mode(6)
         self.avg_reads = 4
         self._old_color = None
+        self._palette = ColorPalette.default()
+
+    @property
+    def palette(self):
+        """Colors which readings are classified as
+
+        :getter: Returns palette
+        :setter: Sets palette, from a ColorPalette or a list of (name, (r, g, b)) tuples
+        :return: ColorPalette
+        """
+        return self._palette
+
+    @palette.setter
+    def palette(self, value):
+        """Set colors which readings are classified as
+
+        :param value: ColorPalette or list of (name, (r, g, b)) tuples
+        """
+        if value is None:
+            value = ColorPalette.default()
+        elif not isinstance(value, ColorPalette):
+            value = ColorPalette(value)
+        self._palette = value
 
     def segment_color(self, r, g, b):
         """Return the color name from RGB
@@ -35,22 +61,7 @@ class ColorSensor(Device):
         :return: Name of the color as a string
         :rtype: str
         """
-        table = [("black", (0, 0, 0)),
-                 ("violet", (127, 0, 255)),
-                 ("blue", (0, 0, 255)),
-                 ("cyan", (0, 183, 235)),
-                 ("green", (0, 128, 0)),
-                 ("yellow", (255, 255, 0)),
-                 ("red", (255, 0, 0)),
-                 ("white", (255, 255, 255))]
-        near = ""
-        euc = math.inf
-        for itm in table:
-            cur = math.sqrt((r - itm[1][0])**2 + (g - itm[1][1])**2 + (b - itm[1][2])**2)
-            if cur < euc:
-                near = itm[0]
-                euc = cur
-        return near
+        return self.palette.classify(r, g, b)
 
     def rgb_to_hsv(self, r, g, b):
         """Convert RGB to HSV
@@ -115,14 +126,14 @@ class ColorSensor(Device):
             readings.append(self.get()[0])
         return int(sum(readings) / len(readings))
 
+    def _scale(self, read):
+        return [int((read[0] / 1024) * 255),
+                int((read[1] / 1024) * 255),
+                int((read[2] / 1024) * 255),
+                int((read[3] / 1024) * 255)]
+
     def _avgrgbi(self, reads):
-        readings = []
-        for read in reads:
-            read = [int((read[0] / 1024) * 255),
-                    int((read[1] / 1024) * 255),
-                    int((read[2] / 1024) * 255),
-                    int((read[3] / 1024) * 255)]
-            readings.append(read)
+        readings = [self._scale(read) for read in reads]
         rgbi = []
         for i in range(4):
             rgbi.append(int(sum([rgbi[i] for rgbi in readings]) / len(readings)))
@@ -164,9 +175,9 @@ class ColorSensor(Device):
         return (hue, sat, val)
 
     def _cb_handle(self, lst):
-        self._data.append(lst[:4])
-        if len(self._data) == self.avg_reads:
-            r, g, b, _ = self._avgrgbi(self._data)
+        rgbi = self._avg.add(self._scale(lst))
+        if rgbi is not None:
+            r, g, b, _ = rgbi
             seg = self.segment_color(r, g, b)
             if self._cmp(seg, self._color):
                 with self._cond:
@@ -177,14 +188,17 @@ class ColorSensor(Device):
         """Wait until specific color
 
         :param color: Color to look for
+        :raises BuildHATError: Occurs if called within Hat.batch()
         """
+        check_not_batching()
         self.mode(5)
         self._cond = Condition()
-        self._data = deque(maxlen=self.avg_reads)
+        self._avg = RunningAverage(self.avg_reads, 4)
         self._color = color
         self._cmp = lambda x, y: x == y
-        self.callback(self._cb_handle)
         with self._cond:
+            # Held until waiting, so a match found straight away isn't missed
+            self.callback(self._cb_handle)
             self._cond.wait()
         self.callback(None)
 
@@ -193,17 +207,20 @@ class ColorSensor(Device):
 
         :return: Name of the color as a string
         :rtype: str
+        :raises BuildHATError: Occurs if called within Hat.batch()
         """
+        check_not_batching()
         self.mode(5)
         if self._old_color is None:
             self._old_color = self.get_color()
             return self._old_color
         self._cond = Condition()
-        self._data = deque(maxlen=self.avg_reads)
+        self._avg = RunningAverage(self.avg_reads, 4)
         self._color = self._old_color
         self._cmp = lambda x, y: x != y
-        self.callback(self._cb_handle)
         with self._cond:
+            # Held until waiting, so a match found straight away isn't missed
+            self.callback(self._cb_handle)
             self._cond.wait()
         self.callback(None)
         return self._old_color
@@ -1,33 +1,233 @@
 """Color distance sensor handling functionality"""
 
-import math
-from collections import deque
+import threading
+import time
+import weakref
 from threading import Condition
 
 from .devices import Device
+from .exc import BuildHATError
+from .palette import ColorPalette, RunningAverage
+from .serinterface import check_not_batching
+
+
+class IRScheduler:
+    """Sends Power Functions Combo PWM state to IR receivers in the background
+
+    Each channel holds the latest mode of its A and B outputs. Setting a mode
+    returns straight away; a changed channel is sent on the next transmission
+    slot, channels take turns, and a channel with its motors running is sent
+    again every KEEPALIVE seconds, as receivers float their outputs when they
+    stop hearing Combo PWM messages. Transmitting leaves the sensor in its
+    IR transmit mode, and reading from the sensor switches it back again.
+
+    :param sensor: ColorDistanceSensor to transmit from
+    """
+
+    KEEPALIVE = 0.5
+    GAP = 0.03
+    FLOAT = 0x0
+    BRAKE = 0x8
+
+    def __init__(self, sensor):
+        """Create scheduler
+
+        :param sensor: ColorDistanceSensor to transmit from
+        """
+        self._sensor = weakref.ref(sensor)
+        self._cond = threading.Condition()
+        self._state = [[IRScheduler.FLOAT, IRScheduler.FLOAT] for _ in range(4)]
+        self._dirty = [False] * 4
+        self._sent = [0.0] * 4
+        self._next = 0
+        self._th = None
+        self.sent = 0
+
+    def set_combo_pwm(self, channel, port_b_mode=None, port_a_mode=None):
+        """Set the modes of the outputs on a channel, leaving an output unchanged if None
+
+        :param channel: 1-4 indicating the channel of the receiver
+        :param port_b_mode: 0-15, as for ColorDistanceSensor.send_ir_combo_pwm()
+        :param port_a_mode: 0-15, as for ColorDistanceSensor.send_ir_combo_pwm()
+        :return: False if invalid channel or mode given
+        """
+        if channel not in (1, 2, 3, 4):
+            return False
+        for mode in (port_b_mode, port_a_mode):
+            if mode is not None and not (0x0 <= mode <= 0xF):
+                return False
+        with self._cond:
+            state = self._state[channel - 1]
+            new = [state[0] if port_b_mode is None else port_b_mode,
+                   state[1] if port_a_mode is None else port_a_mode]
+            if new != state:
+                self._state[channel - 1] = new
+                self._dirty[channel - 1] = True
+                self._start()
+                self._cond.notify()
+        return True
+
+    def set_output(self, channel, port, mode):
+        """Set the mode of one output on a channel
+
+        :param channel: 1-4 indicating the channel of the receiver
+        :param port: 'A' or 'B'
+        :param mode: 0-15, as for ColorDistanceSensor.send_ir_combo_pwm()
+        :return: False if invalid channel, port or mode given
+        """
+        if port in ('A', 'a'):
+            return self.set_combo_pwm(channel, port_a_mode=mode)
+        elif port in ('B', 'b'):
+            return self.set_combo_pwm(channel, port_b_mode=mode)
+        return False
+
+    def get_output(self, channel, port):
+        """Get the mode last set for an output
+
+        :param channel: 1-4 indicating the channel of the receiver
+        :param port: 'A' or 'B'
+        :return: 0-15
+        """
+        return self._state[channel - 1][0 if port in ('B', 'b') else 1]
+
+    def stop(self):
+        """Float every output, then stop transmitting once that has been sent"""
+        for channel in range(1, 5):
+            self.set_combo_pwm(channel, IRScheduler.FLOAT, IRScheduler.FLOAT)
+
+    def _running(self, idx):
+        return any(mode not in (IRScheduler.FLOAT, IRScheduler.BRAKE) for mode in self._state[idx])
+
+    def _start(self):
+        if self._th is None:
+            self._th = threading.Thread(target=self._run)
+            self._th.daemon = True
+            self._th.start()
+
+    def _pick(self, now):
+        """Choose the next channel to send, changed channels first
+
+        :param now: Current time
+        :return: Channel index and time to wait, one of which is None
+        """
+        order = [(self._next + i) % 4 for i in range(4)]
+        for idx in order:
+            if self._dirty[idx]:
+                return idx, None
+        due = None
+        for idx in order:
+            if self._running(idx):
+                when = self._sent[idx] + IRScheduler.KEEPALIVE
+                if when <= now:
+                    return idx, None
+                due = when if due is None else min(due, when)
+        return None, due
+
+    def _run(self):
+        while True:
+            with self._cond:
+                while True:
+                    idx, due = self._pick(time.monotonic())
+                    if idx is not None:
+                        break
+                    if due is None:
+                        # Nothing changed or running, so let the thread go
+                        self._th = None
+                        return
+                    self._cond.wait(due - time.monotonic())
+                self._dirty[idx] = False
+                port_b_mode, port_a_mode = self._state[idx]
+                self._sent[idx] = time.monotonic()
+                self._next = (idx + 1) % 4
+            sensor = self._sensor()
+            if sensor is None:
+                with self._cond:
+                    self._th = None
+                return
+            try:
+                # Combo PWM has no toggle bit, the top bit is the address bit
+                nibble1 = (sensor._ir_address << 3) | (0x1 << 2) | idx
+                sensor._send_ir_nibbles(nibble1, port_b_mode, port_a_mode)
+                self.sent += 1
+            except Exception:
+                # Sensor disconnected, so give up until the state changes again
+                with self._cond:
+                    self._th = None
+                return
+            sensor = None
+            time.sleep(IRScheduler.GAP)
 
 
 class ColorDistanceSensor(Device):
     """Color Distance sensor
 
     :param port: Port of device
+    :param hat: Optional Hat the device is attached to, otherwise the first one
     :raises DeviceError: Occurs if there is no colordistance sensor attached to port
     """
 
-    def __init__(self, port):
+    # Distance, reflected light and RGB in one stream, so mixing queries doesn't switch modes
+    COMBI = [(1, 0), (3, 0), (6, 0), (6, 1), (6, 2)]
+    # Mode and index of the first value of each reading, from COMBI or from their own modes
+    COMBI_MODES = {"distance": (COMBI, 0), "reflected": (COMBI, 1), "rgb": (COMBI, 2)}
+    SINGLE_MODES = {"distance": (1, 0), "reflected": (3, 0), "rgb": (6, 0)}
+    COMBI_TIMEOUT = 1
+
+    def __init__(self, port, hat=None):
         """
         Initialise color distance sensor
 
         :param port: Port of device
+        :param hat: Optional Hat the device is attached to, otherwise the first one
         """
-        super().__init__(port)
+        super().__init__(port, hat)
         self.on()
-        self.mode(6)
+        self._modes = ColorDistanceSensor.COMBI_MODES if self._streams_combi() else ColorDistanceSensor.SINGLE_MODES
         self.avg_reads = 4
         self._old_color = None
+        self._palette = ColorPalette.default()
         self._ir_channel = 0x0
         self._ir_address = 0x0
         self._ir_toggle = 0x0
+        self._ir_scheduler = None
+        # Held while switching modes and reading, so IR sends from the scheduler can't switch mode under a reader
+        self._modelock = threading.RLock()
+
+    def _streams_combi(self):
+        """Check the sensor sends frames of COMBI
+
+        Otherwise each reading switches to its own mode, as it used to.
+
+        :return: Whether COMBI can be read from
+        """
+        self.mode(ColorDistanceSensor.COMBI)
+        try:
+            data = self.get(timeout=ColorDistanceSensor.COMBI_TIMEOUT)
+        except BuildHATError:
+            return False
+        return len(data) == len(ColorDistanceSensor.COMBI)
+
+    @property
+    def palette(self):
+        """Colors which readings are classified as
+
+        :getter: Returns palette
+        :setter: Sets palette, from a ColorPalette or a list of (name, (r, g, b)) tuples
+        :return: ColorPalette
+        """
+        return self._palette
+
+    @palette.setter
+    def palette(self, value):
+        """Set colors which readings are classified as
+
+        :param value: ColorPalette or list of (name, (r, g, b)) tuples
+        """
+        if value is None:
+            value = ColorPalette.default()
+        elif not isinstance(value, ColorPalette):
+            value = ColorPalette(value)
+        self._palette = value
 
     def segment_color(self, r, g, b):
         """Return the color name from HSV
@@ -38,22 +238,7 @@ class ColorDistanceSensor(Device):
         :return: Name of the color as a string
         :rtype: str
         """
-        table = [("black", (0, 0, 0)),
-                 ("violet", (127, 0, 255)),
-                 ("blue", (0, 0, 255)),
-                 ("cyan", (0, 183, 235)),
-                 ("green", (0, 128, 0)),
-                 ("yellow", (255, 255, 0)),
-                 ("red", (255, 0, 0)),
-                 ("white", (255, 255, 255))]
-        near = ""
-        euc = math.inf
-        for itm in table:
-            cur = math.sqrt((r - itm[1][0]) ** 2 + (g - itm[1][1]) ** 2 + (b - itm[1][2]) ** 2)
-            if cur < euc:
-                near = itm[0]
-                euc = cur
-        return near
+        return self.palette.classify(r, g, b)
 
     def rgb_to_hsv(self, r, g, b):
         """Convert RGB to HSV
@@ -100,10 +285,11 @@ class ColorDistanceSensor(Device):
         :return: Ambient light
         :rtype: int
         """
-        self.mode(4)
-        readings = []
-        for _ in range(self.avg_reads):
-            readings.append(self.get()[0])
+        with self._modelock:
+            self.mode(4)
+            readings = []
+            for _ in range(self.avg_reads):
+                readings.append(self.get()[0])
         return int(sum(readings) / len(readings))
 
     def get_reflected_light(self):
@@ -112,10 +298,12 @@ class ColorDistanceSensor(Device):
         :return: Reflected light
         :rtype: int
         """
-        self.mode(3)
-        readings = []
-        for _ in range(self.avg_reads):
-            readings.append(self.get()[0])
+        mode, i = self._modes["reflected"]
+        with self._modelock:
+            self.mode(mode)
+            readings = []
+            for _ in range(self.avg_reads):
+                readings.append(self.get()[i])
         return int(sum(readings) / len(readings))
 
     def get_distance(self):
@@ -124,20 +312,22 @@ class ColorDistanceSensor(Device):
         :return: Distance
         :rtype: int
         """
-        self.mode(1)
-        distance = self.get()[0]
+        mode, i = self._modes["distance"]
+        with self._modelock:
+            self.mode(mode)
+            distance = self.get()[i]
         return distance
 
     def _clamp(self, val, small, large):
         return max(small, min(val, large))
 
+    def _scale(self, read):
+        return [int((self._clamp(read[0], 0, 400) / 400) * 255),
+                int((self._clamp(read[1], 0, 400) / 400) * 255),
+                int((self._clamp(read[2], 0, 400) / 400) * 255)]
+
     def _avgrgb(self, reads):
-        readings = []
-        for read in reads:
-            read = [int((self._clamp(read[0], 0, 400) / 400) * 255),
-                    int((self._clamp(read[1], 0, 400) / 400) * 255),
-                    int((self._clamp(read[2], 0, 400) / 400) * 255)]
-            readings.append(read)
+        readings = [self._scale(read) for read in reads]
         rgb = []
         for i in range(3):
             rgb.append(int(sum([rgb[i] for rgb in readings]) / len(readings)))
@@ -146,19 +336,27 @@ class ColorDistanceSensor(Device):
     def get_color_rgb(self):
         """Return the color
 
-        :return: RGBI representation
+        :return: RGB representation
         :rtype: list
         """
-        self.mode(6)
-        reads = []
-        for _ in range(self.avg_reads):
-            reads.append(self.get())
+        mode, i = self._modes["rgb"]
+        with self._modelock:
+            self.mode(mode)
+            reads = []
+            for _ in range(self.avg_reads):
+                reads.append(self.get()[i:i + 3])
         return self._avgrgb(reads)
 
     def _cb_handle(self, lst):
-        self._data.append(lst)
-        if len(self._data) == self.avg_reads:
-            r, g, b = self._avgrgb(self._data)
+        i = self._modes["rgb"][1]
+        if len(lst) != i + 3:
+            # Left in mode 7 after transmitting IR, so go back to the mode being waited on
+            with self._modelock:
+                self.mode(self._modes["rgb"][0])
+            return
+        rgb = self._avg.add(self._scale(lst[i:]))
+        if rgb is not None:
+            r, g, b = rgb
             seg = self.segment_color(r, g, b)
             if self._cmp(seg, self._color):
                 with self._cond:
@@ -169,14 +367,18 @@ class ColorDistanceSensor(Device):
         """Wait until specific color
 
         :param color: Color to look for
+        :raises BuildHATError: Occurs if called within Hat.batch()
         """
-        self.mode(6)
+        check_not_batching()
+        with self._modelock:
+            self.mode(self._modes["rgb"][0])
         self._cond = Condition()
-        self._data = deque(maxlen=self.avg_reads)
+        self._avg = RunningAverage(self.avg_reads, 3)
         self._color = color
         self._cmp = lambda x, y: x == y
-        self.callback(self._cb_handle)
         with self._cond:
+            # Held until waiting, so a match found straight away isn't missed
+            self.callback(self._cb_handle)
             self._cond.wait()
         self.callback(None)
 
@@ -185,17 +387,21 @@ class ColorDistanceSensor(Device):
 
         :return: Name of the color as a string
         :rtype: str
+        :raises BuildHATError: Occurs if called within Hat.batch()
         """
-        self.mode(6)
+        check_not_batching()
+        with self._modelock:
+            self.mode(self._modes["rgb"][0])
         if self._old_color is None:
             self._old_color = self.get_color()
             return self._old_color
         self._cond = Condition()
-        self._data = deque(maxlen=self.avg_reads)
+        self._avg = RunningAverage(self.avg_reads, 3)
         self._color = self._old_color
         self._cmp = lambda x, y: x != y
-        self.callback(self._cb_handle)
         with self._cond:
+            # Held until waiting, so a match found straight away isn't missed
+            self.callback(self._cb_handle)
             self._cond.wait()
         self.callback(None)
         return self._old_color
@@ -220,6 +426,17 @@ class ColorDistanceSensor(Device):
         # Internally: 0-3
         self._ir_channel = int(check_chan) - 1
 
+    @property
+    def ir_scheduler(self):
+        """Background sender of Combo PWM state, for driving several IR receivers at once
+
+        :getter: Returns scheduler, created the first time it is used
+        :return: IRScheduler
+        """
+        if self._ir_scheduler is None:
+            self._ir_scheduler = IRScheduler(self)
+        return self._ir_scheduler
+
     @property
     def ir_address(self):
         """IR Address space of 0x0 for default PoweredUp or 0x1 for extra space"""
@@ -508,7 +725,6 @@ class ColorDistanceSensor(Device):
         #    RAW: 00000000 0000FFFF    PCT: 00000000 00000064    SI: 00000000 0000FFFF
 
         mode = 7
-        self.mode(mode)
 
         # The upper bits of data[2] are ignored
         if nibble1 > 0xF or nibble2 > 0xF or nibble3 > 0xF:
@@ -528,7 +744,10 @@ class ColorDistanceSensor(Device):
         # print(" ".join('{:04b}'.format(nibble3)))
         # print(" ".join('{:08b}'.format(n) for n in data))
 
-        self._write1(data)
+        with self._modelock:
+            # Stays in mode 7, so repeated messages are just the write; getters switch back
+            self.mode(mode)
+            self._write1(data)
         return True
 
     def on(self):
@@ -0,0 +1,347 @@
+"""buildhatd, which shares one Build HAT between several processes"""
+
+import argparse
+import logging
+import os
+import selectors
+import signal
+import socket
+import threading
+
+from .devices import Device
+from .serinterface import BuildHAT
+
+
+class Client:
+    """Process connected to buildhatd"""
+
+    def __init__(self, sock):
+        """Client
+
+        :param sock: Socket connected to client
+        """
+        self.sock = sock
+        self.inbuf = bytearray()
+        self.outbuf = bytearray()
+        self.lock = threading.Lock()
+        self.port = None
+        self.closed = False
+        self.writing = False
+
+
+class Daemon:
+    """Keeps the Build HAT open and multiplexes clients over a Unix socket
+
+    Each client claims the ports it uses. Commands for ports a client has
+    not claimed are dropped, as are commands which would affect the whole
+    HAT, such as reboot, load or plimit, and malformed port numbers. Lines
+    read from the firmware are parsed once to route them: data and completion messages go to the client that
+    claimed the port, data also goes to clients observing the port, and
+    everything else goes to every client.
+    """
+
+    MAX_BACKLOG = 1 << 20
+    GLOBAL_COMMANDS = ("vin", "version", "ledmode")
+    # plimit sets the limit of every port, unlike port_plimit
+    HAT_COMMANDS = ("?", "clear", "clear_faults", "debug", "echo", "help", "load", "plimit", "reboot", "signature",
+                    "verbose")
+    PORT_COMMANDS = ("port", BuildHAT.CLAIM, BuildHAT.RELEASE, BuildHAT.OBSERVE, BuildHAT.UNOBSERVE)
+    STATUS = (BuildHAT.CONNECTED, BuildHAT.CONNECTEDPASSIVE, BuildHAT.DISCONNECTED,
+              BuildHAT.DEVTIMEOUT, BuildHAT.NOTCONNECTED)
+
+    def __init__(self, path=None, snapshot=None, **kwargs):
+        """Open the Build HAT and listen for clients
+
+        :param path: Optional path of socket to listen on
+        :param snapshot: Optional name of shared memory block to publish the latest data into
+        :param kwargs: Passed to BuildHAT, such as device, debug or trace
+        """
+        self.path = path if path is not None else Device.daemon_socket()
+        kwargs.setdefault("device", "/dev/serial0")
+        self.hat = Device._setup(**kwargs)
+        self.clients = []
+        self.owners = [None] * 4
+        self.observers = [() for _ in range(4)]
+        self.status = [f"P{p}{BuildHAT.NOTCONNECTED}" for p in range(4)]
+        self.hat.add_tap(self._tap)
+        # List again so status holds the firmware's own lines for each port
+        self.hat.readyevt.clear()
+        self.hat.startlist()
+        self.hat.readyevt.wait()
+        self.snapshot = None
+        self.combis = [set() for _ in range(4)]
+        if snapshot is not None:
+            from .snapshot import SnapshotWriter
+
+            self.snapshot = SnapshotWriter(self.hat, snapshot)
+
+        if os.path.exists(self.path):
+            probe = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+            try:
+                probe.connect(self.path)
+                probe.close()
+                raise RuntimeError(f"buildhatd already running on {self.path}")
+            except ConnectionRefusedError:
+                # Left behind by a daemon which didn't exit cleanly
+                os.unlink(self.path)
+        self.server = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        self.server.bind(self.path)
+        self.server.listen()
+        self.server.setblocking(False)
+        self.wakew, self.waker = socket.socketpair()
+        self.waker.setblocking(False)
+        self.sel = selectors.DefaultSelector()
+        self.sel.register(self.server, selectors.EVENT_READ, None)
+        self.sel.register(self.waker, selectors.EVENT_READ, None)
+        self.running = True
+
+    def _tap(self, line):
+        """Route a line from the firmware to clients
+
+        :param line: Line read from the firmware
+        """
+        data = (line + "\r\n").encode()
+        if line[0] == "P" and line[1] in "0123":
+            port = int(line[1])
+            if line[2] == ":" and line[2:].startswith(Daemon.STATUS):
+                if line[2:].startswith((BuildHAT.DISCONNECTED, BuildHAT.DEVTIMEOUT)):
+                    # What the firmware would say for the port if asked to list again
+                    self.status[port] = f"P{port}{BuildHAT.NOTCONNECTED}"
+                else:
+                    self.status[port] = line
+                targets = self.clients
+            else:
+                owner = self.owners[port]
+                targets = () if owner is None else (owner,)
+                if line[2] in "CM":
+                    targets += tuple(c for c in self.observers[port] if c is not owner)
+        else:
+            targets = self.clients
+        for client in targets:
+            self._send(client, data)
+
+    def _send(self, client, data):
+        with client.lock:
+            if len(client.outbuf) > Daemon.MAX_BACKLOG:
+                # Not keeping up, so drop it rather than hold up everyone else
+                client.closed = True
+            else:
+                client.outbuf += data
+        try:
+            self.wakew.send(b"\0")
+        except BlockingIOError:
+            pass
+
+    def _command(self, client, line):
+        """Handle a line of commands from a client
+
+        :param client: Client which sent the line
+        :param line: Commands separated by semicolons
+        """
+        out = []
+        emitted = None
+        for cmd in line.split(";"):
+            cmd = cmd.strip()
+            if cmd == "":
+                continue
+            words = cmd.split()
+            if words[0] in Daemon.PORT_COMMANDS:
+                port = Daemon._port(words)
+                if words[0] == "port":
+                    # Commands for a port are dropped until a valid one is given
+                    client.port = port
+                elif port is None:
+                    continue
+                elif words[0] in (BuildHAT.CLAIM, BuildHAT.RELEASE):
+                    self._claim(client, words[0], port)
+                else:
+                    self._observe(client, words[0], port)
+            elif words[0] == "list":
+                self._send(client, "".join(f"{status}\r\n" for status in self.status).encode())
+            elif words[0] in Daemon.GLOBAL_COMMANDS:
+                out.append(cmd)
+            elif words[0] in Daemon.HAT_COMMANDS:
+                continue
+            elif client.port is not None and self.owners[client.port] is client:
+                if emitted != client.port:
+                    # Lines from different clients get merged, so always say which port
+                    out.append(f"port {client.port}")
+                    emitted = client.port
+                out.append(cmd)
+                if self.snapshot is not None:
+                    self._track(client.port, words)
+        if len(out) > 0:
+            self.hat.write(f"{' ; '.join(out)}\r".encode())
+
+    @staticmethod
+    def _port(words):
+        """Port number given to a command
+
+        :param words: Command split into words
+        :return: Port number, or None if it isn't 0 to 3
+        """
+        if len(words) != 2 or words[1] not in ("0", "1", "2", "3"):
+            return None
+        return int(words[1])
+
+    def _track(self, port, words):
+        """Follow the modes clients select, so frames can be decoded here for the snapshot
+
+        :param port: Port number
+        :param words: Command split into words
+        """
+        conn = self.hat.connections[port]
+        if len(words) > 1 and not words[1].isdigit():
+            # The firmware rejects it too
+            return
+        if words[0] == "combi" and len(words) > 1:
+            if len(words) > 2:
+                self.combis[port].add(int(words[1]))
+            else:
+                self.combis[port].discard(int(words[1]))
+        elif words[0] == "select":
+            if len(words) == 1:
+                conn.simplemode = -1
+                conn.combimode = -1
+            elif int(words[1]) in self.combis[port]:
+                conn.simplemode = -1
+                conn.combimode = int(words[1])
+            else:
+                conn.simplemode = int(words[1])
+                conn.combimode = -1
+
+    def _claim(self, client, cmd, port):
+        if cmd == BuildHAT.CLAIM:
+            if self.owners[port] is None or self.owners[port] is client:
+                self.owners[port] = client
+                self._send(client, f"{BuildHAT.CLAIMED} {port}\r\n".encode())
+            else:
+                self._send(client, f"{BuildHAT.BUSY} {port}\r\n".encode())
+        elif self.owners[port] is client:
+            self.owners[port] = None
+
+    def _observe(self, client, cmd, port):
+        # Replaced as a whole, as the serial reader thread routes frames from it
+        observers = tuple(c for c in self.observers[port] if c is not client)
+        if cmd == BuildHAT.OBSERVE:
+            observers += (client,)
+        self.observers[port] = observers
+
+    def _accept(self):
+        sock, _ = self.server.accept()
+        sock.setblocking(False)
+        client = Client(sock)
+        self.clients = self.clients + [client]
+        self.sel.register(sock, selectors.EVENT_READ, client)
+        logging.debug("buildhatd: client connected")
+
+    def _drop(self, client):
+        self.sel.unregister(client.sock)
+        client.sock.close()
+        self.clients = [c for c in self.clients if c is not client]
+        turnoff = ""
+        for p in range(4):
+            self._observe(client, BuildHAT.UNOBSERVE, p)
+            if self.owners[p] is client:
+                self.owners[p] = None
+                turnoff += f"port {p} ; pwm ; coast ; off ; select ; "
+                self._track(p, ["select"])
+        if turnoff != "":
+            self.hat.write(f"{turnoff}\r".encode())
+        logging.debug("buildhatd: client disconnected")
+
+    def _read(self, client):
+        try:
+            data = client.sock.recv(4096)
+        except (BlockingIOError, InterruptedError):
+            return
+        except OSError:
+            data = b""
+        if len(data) == 0:
+            client.closed = True
+            return
+        client.inbuf += data.replace(b"\n", b"\r")
+        while True:
+            end = client.inbuf.find(b"\r")
+            if end == -1:
+                break
+            line = client.inbuf[:end].decode('utf-8', 'ignore')
+            del client.inbuf[:end + 1]
+            self._command(client, line)
+
+    def _flush(self, client):
+        with client.lock:
+            if len(client.outbuf) == 0:
+                return
+            try:
+                sent = client.sock.send(client.outbuf)
+            except (BlockingIOError, InterruptedError):
+                sent = 0
+            except OSError:
+                client.closed = True
+                return
+            del client.outbuf[:sent]
+            pending = len(client.outbuf) > 0
+        if pending != client.writing:
+            # Only wait for the socket to drain while there is a backlog
+            client.writing = pending
+            events = selectors.EVENT_READ | (selectors.EVENT_WRITE if pending else 0)
+            self.sel.modify(client.sock, events, client)
+
+    def serve(self):
+        """Handle clients until stop is called"""
+        while self.running:
+            for key, mask in self.sel.select():
+                if key.fileobj is self.server:
+                    self._accept()
+                elif key.fileobj is self.waker:
+                    try:
+                        self.waker.recv(4096)
+                    except BlockingIOError:
+                        pass
+                elif mask & selectors.EVENT_READ:
+                    self._read(key.data)
+            for client in self.clients:
+                if client.closed:
+                    self._drop(client)
+                else:
+                    self._flush(client)
+        self.close()
+
+    def stop(self):
+        """Stop serving, from another thread or a signal handler"""
+        self.running = False
+        self.wakew.send(b"\0")
+
+    def close(self):
+        """Disconnect clients and stop listening"""
+        for client in self.clients:
+            self._drop(client)
+        self.sel.close()
+        self.server.close()
+        if os.path.exists(self.path):
+            os.unlink(self.path)
+        self.hat.remove_tap(self._tap)
+        if self.snapshot is not None:
+            self.snapshot.close()
+
+
+def main():
+    """Run buildhatd"""
+    parser = argparse.ArgumentParser(description="Share a Build HAT between processes")
+    parser.add_argument("--socket", help="Path of socket to listen on")
+    parser.add_argument("--device", default="/dev/serial0", help="Serial device of Build HAT")
+    parser.add_argument("--snapshot", metavar="NAME", help="Publish the latest data into shared memory")
+    parser.add_argument("--debug", action="store_true", help="Log debug information")
+    parser.add_argument("--trace", metavar="FILE", help="Record all bytes sent and received into a binary trace")
+    args = parser.parse_args()
+    daemon = Daemon(args.socket, args.snapshot, device=args.device, debug=args.debug, trace=args.trace)
+    signal.signal(signal.SIGTERM, lambda signum, frame: daemon.stop())
+    try:
+        daemon.serve()
+    except KeyboardInterrupt:
+        daemon.close()
+
+
+if __name__ == "__main__":
+    main()
@@ -1,18 +1,25 @@
 """Functionality for handling Build HAT devices"""
 
 import os
+import stat
 import sys
 import weakref
-from concurrent.futures import Future
 
+from .capture import SampleRing
 from .exc import DeviceError
-from .serinterface import BuildHAT
+from .serinterface import BuildHAT, CallbackDispatcher, CallbackPolicy, SocketSerial
 
 
 class Device:
-    """Creates a single instance of the buildhat for all devices to use"""
+    """Creates a single instance of the buildhat for all devices to use
+
+    Further Build HATs, such as ones on other UARTs, each get their own
+    instance, with its own threads, created by passing their device to Hat.
+    """
 
     _instance = None
+    # BuildHAT for each serial device, so that Hat objects for a device share it
+    _hats = {}
     _started = 0
     _device_names = {1: ("PassiveMotor", "PassiveMotor"),
                      2: ("PassiveMotor", "PassiveMotor"),
@@ -33,18 +40,14 @@ class Device:
                      75: ("Motor", "Medium Angular Motor (Grey)"),            # 88018
                      76: ("Motor", "Large Angular Motor (Grey)")}             # 88017
 
-    _used = {0: False,
-             1: False,
-             2: False,
-             3: False}
-
     UNKNOWN_DEVICE = "Unknown"
     DISCONNECTED_DEVICE = "Disconnected"
 
-    def __init__(self, port):
+    def __init__(self, port, hat=None):
         """Initialise device
 
         :param port: Port of device
+        :param hat: Optional Hat the device is attached to, otherwise the first one
         :raises DeviceError: Occurs if incorrect port specified or port already used
         """
         if not isinstance(port, str) or len(port) != 1:
@@ -52,13 +55,16 @@ class Device:
         p = ord(port) - ord('A')
         if not (p >= 0 and p <= 3):
             raise DeviceError("Invalid port")
-        if Device._used[p]:
+        buildhat = Device._setup() if hat is None else getattr(hat, "_buildhat", hat)
+        if buildhat.used[p]:
             raise DeviceError("Port already used")
         self.port = p
-        Device._setup()
+        self._buildhat = buildhat
         self._simplemode = -1
         self._combimode = -1
         self._modestr = ""
+        self._selected = None
+        self._filters = None
         self._typeid = self._conn.typeid
         self._interval = 10
         if (
@@ -66,12 +72,70 @@ class Device:
             and Device._device_names[self._typeid][0] != type(self).__name__  # noqa: W503
         ) or self._typeid == -1:
             raise DeviceError(f'There is not a {type(self).__name__} connected to port {port} (Found {self.name})')
-        Device._used[p] = True
+        if not buildhat.claim(p):
+            raise DeviceError("Port already used by another process")
+        buildhat.used[p] = True
+
+    @staticmethod
+    def daemon_socket():
+        """Path of the socket buildhatd listens on
+
+        :return: Value of BUILDHAT_SOCKET, or the default path
+        """
+        return os.environ.get("BUILDHAT_SOCKET", BuildHAT.DAEMON_SOCKET)
+
+    @staticmethod
+    def _connect_daemon(path):
+        """Connect to buildhatd, if it is running and can be trusted
+
+        Anyone can create a file in /tmp, so only a socket owned by root or
+        by this user is used. A socket left behind by a buildhatd which
+        didn't exit cleanly refuses the connection.
+
+        :param path: Path of buildhatd socket
+        :return: SocketSerial, or None to open the serial port directly
+        """
+        try:
+            st = os.stat(path)
+        except OSError:
+            return None
+        if not stat.S_ISSOCK(st.st_mode) or st.st_uid not in (0, os.getuid()):
+            return None
+        try:
+            return SocketSerial(path)
+        except OSError:
+            return None
 
     @staticmethod
     def _setup(**kwargs):
-        if Device._instance:
-            return
+        """Get the BuildHAT for a device, starting it if this is the first use
+
+        :param kwargs: Passed to BuildHAT, such as device, debug or trace
+        :return: BuildHAT for the device, or the first one if no device is given
+        :raises BuildHATError: Occurs if the BuildHAT is already open with options that conflict
+        """
+        device = kwargs.pop("device", None)
+        ser = None
+        if device is None:
+            if Device._instance is not None:
+                Device._instance.reuse(**kwargs)
+                return Device._instance
+            ser = Device._connect_daemon(Device.daemon_socket())
+            if ser is not None:
+                # buildhatd owns the serial port, so share it
+                device = "unix:" + Device.daemon_socket()
+            else:
+                device = "/dev/serial0"
+        key = device if isinstance(device, str) else id(device)
+        if key in Device._hats:
+            Device._hats[key].reuse(**kwargs)
+            return Device._hats[key]
+        if ser is not None:
+            kwargs["device"] = ser
+        elif isinstance(device, str) and device.startswith("unix:"):
+            kwargs["device"] = SocketSerial(device[len("unix:"):])
+        else:
+            kwargs["device"] = device
         data = os.path.join(os.path.dirname(sys.modules["buildhat"].__file__), "data/")
         firm = os.path.join(data, "firmware.bin")
         sig = os.path.join(data, "signature.bin")
@@ -79,16 +143,22 @@ class Device:
         vfile = open(ver)
         v = int(vfile.read())
         vfile.close()
-        Device._instance = BuildHAT(firm, sig, v, **kwargs)
-        weakref.finalize(Device._instance, Device._instance.shutdown)
+        buildhat = BuildHAT(firm, sig, v, **kwargs)
+        weakref.finalize(buildhat, buildhat.shutdown)
+        Device._hats[key] = buildhat
+        if Device._instance is None:
+            Device._instance = buildhat
+        return buildhat
 
     def __del__(self):
         """Handle deletion of device"""
-        if hasattr(self, "port") and Device._used[self.port]:
-            Device._used[self.port] = False
+        if hasattr(self, "_buildhat") and self._buildhat.used[self.port]:
+            self._buildhat.used[self.port] = False
             self._conn.callit = None
+            self._conn.filters = ()
             self.deselect()
             self.off()
+            self._buildhat.release(self.port)
 
     @staticmethod
     def name_for_id(typeid):
@@ -116,7 +186,7 @@ class Device:
 
     @property
     def _conn(self):
-        return Device._instance.connections[self.port]
+        return self._buildhat.connections[self.port]
 
     @property
     def connected(self):
@@ -148,7 +218,7 @@ class Device:
 
         :return: Hat instance
         """
-        return Device._instance
+        return self._buildhat
 
     @property
     def name(self):
@@ -190,18 +260,140 @@ class Device:
         """Reverse polarity"""
         self._write(f"port {self.port} ; port_plimit 1 ; set -1\r")
 
-    def get(self):
+    def get(self, fresh=True, timeout=None):
         """Extract information from device
 
+        :param fresh: Wait for the next data from the device, rather than returning the latest received
+        :param timeout: Optional time in seconds to wait for data
         :return: Data from device
+        :raises DeviceError: Occurs if device not in valid mode, or is disconnected while waiting
+        :raises BuildHATError: Occurs if the timeout passes before data arrives
+        """
+        self.isconnected()
+        if self._simplemode == -1 and self._combimode == -1:
+            raise DeviceError("Not in simple or combimode")
+        if not fresh:
+            sample = self._conn.sample
+            if sample is not None:
+                return sample[1]
+        return self._hat.datadone[self.port].wait(timeout=timeout)
+
+    async def get_async(self):
+        """Extract information from device, as a coroutine
+
+        :return: Data from device
+        :raises DeviceError: Occurs if device not in valid mode
+        """
+        self.isconnected()
+        if self._simplemode == -1 and self._combimode == -1:
+            raise DeviceError("Not in simple or combimode")
+        return await self._hat.datadone[self.port].wait_async()
+
+    async def stream(self, maxlen=100):
+        """Asynchronously iterate over data from the device
+
+        For example::
+
+            async for data in sensor.stream():
+                print(data)
+
+        :param maxlen: Number of readings held for a slow consumer, after which the oldest are dropped
+        :raises DeviceError: Occurs if device not in valid mode
+        """
+        self.isconnected()
+        if self._simplemode == -1 and self._combimode == -1:
+            raise DeviceError("Not in simple or combimode")
+        import asyncio
+
+        loop = asyncio.get_running_loop()
+        q = asyncio.Queue(maxlen)
+
+        def push(data):
+            if q.full():
+                q.get_nowait()
+            q.put_nowait(data)
+
+        def listener(timestamp, data):
+            try:
+                loop.call_soon_threadsafe(push, data)
+            except RuntimeError:
+                # Event loop has been closed
+                pass
+
+        conn = self._conn
+        conn.add_listener(listener)
+        try:
+            while True:
+                yield await q.get()
+        finally:
+            conn.remove_listener(listener)
+
+    @property
+    def sample(self):
+        """Latest data received from the device in the current mode
+
+        :return: Tuple of time.monotonic() when received and data, or None if nothing received yet
+        :rtype: tuple
+        """
+        return self._conn.sample
+
+    def start_capture(self, capacity=1000):
+        """Record every sample from the device into a ring buffer
+
+        Samples are stored by the serial reader thread, without using
+        callbacks, and read back with drain() or capture()
+
+        :param capacity: Number of samples kept before the oldest are overwritten
         :raises DeviceError: Occurs if device not in valid mode
         """
         self.isconnected()
         if self._simplemode == -1 and self._combimode == -1:
             raise DeviceError("Not in simple or combimode")
-        ftr = Future()
-        self._hat.portftr[self.port].append(ftr)
-        return ftr.result()
+        self._conn.ring = SampleRing(capacity)
+
+    def stop_capture(self):
+        """Stop recording samples, discarding any not yet read"""
+        self._conn.ring = None
+
+    def drain(self):
+        """Return all recorded samples not yet read
+
+        Each sample is a row of the time.monotonic() it was received
+        followed by the device values, see :class:`buildhat.capture.SampleRing`
+
+        :return: Rows of samples, oldest first
+        :rtype: array.array
+        :raises DeviceError: Occurs if not capturing
+        """
+        ring = self._conn.ring
+        if ring is None:
+            raise DeviceError("Not capturing")
+        return ring.drain()
+
+    def capture(self, n, timeout=None):
+        """Wait for n recorded samples and return them
+
+        If start_capture() has not been called, captures just the next n samples
+
+        :param n: Number of samples
+        :param timeout: Seconds to wait, or None to wait indefinitely
+        :return: Rows of samples, oldest first
+        :rtype: array.array
+        :raises DeviceError: Occurs if timed out
+        """
+        ring = self._conn.ring
+        temporary = ring is None
+        if temporary:
+            self.start_capture(n)
+            ring = self._conn.ring
+        try:
+            block = ring.wait(n, timeout)
+        finally:
+            if temporary:
+                self.stop_capture()
+        if block is None:
+            raise DeviceError("Timed out capturing samples")
+        return block
 
     def mode(self, modev):
         """Set combimode or simple mode
@@ -213,7 +405,7 @@ class Device:
             modestr = ""
             for t in modev:
                 modestr += f"{t[0]} {t[1]} "
-            if self._simplemode == -1 and self._combimode == 0 and self._modestr == modestr:
+            if self._simplemode == -1 and self._combimode == 0 and self._modestr == modestr and self._selected is not None:
                 return
             self._write(f"port {self.port}; select\r")
             self._combimode = 0
@@ -222,10 +414,15 @@ class Device:
                          f"selrate {self._interval}\r"))
             self._simplemode = -1
             self._modestr = modestr
+            self._selected = (self._conn.generation, 0, self._interval)
             self._conn.combimode = 0
             self._conn.simplemode = -1
+            self._conn.sample = None
+            if self._conn.ring is not None:
+                self._conn.ring.reset()
         else:
-            if self._combimode == -1 and self._simplemode == int(modev):
+            # Still needs selecting again after deselect() or off()
+            if self._combimode == -1 and self._simplemode == int(modev) and self._selected is not None:
                 return
             # Remove combi mode
             if self._combimode != -1:
@@ -234,8 +431,12 @@ class Device:
             self._combimode = -1
             self._simplemode = int(modev)
             self._write(f"port {self.port} ; select {int(modev)} ; selrate {self._interval}\r")
+            self._selected = (self._conn.generation, int(modev), self._interval)
             self._conn.combimode = -1
             self._conn.simplemode = int(modev)
+            self._conn.sample = None
+            if self._conn.ring is not None:
+                self._conn.ring.reset()
 
     def select(self):
         """Request data from mode
@@ -250,6 +451,23 @@ class Device:
         else:
             raise DeviceError("Not in simple or combimode")
         self._write(f"port {self.port} ; select {idx} ; selrate {self._interval}\r")
+        self._selected = (self._conn.generation, idx, self._interval)
+
+    def _select_cmd(self, idx):
+        """Build command to select data from a mode, unless already selected
+
+        :param idx: Mode, or combimode, to select
+        :return: Command string, empty if nothing needs sending
+        """
+        selected = (self._conn.generation, idx, self._interval)
+        if self._selected == selected:
+            return ""
+        self._selected = selected
+        return f"select {idx} ; selrate {self._interval} ; "
+
+    def _forget_config(self):
+        """Forget what has been configured on the port, so it is sent again"""
+        self._selected = None
 
     def on(self):
         """Turn on sensor"""
@@ -258,14 +476,16 @@ class Device:
     def off(self):
         """Turn off sensor"""
         self._write(f"port {self.port} ; off\r")
+        self._forget_config()
 
     def deselect(self):
         """Unselect data from mode"""
         self._write(f"port {self.port} ; select\r")
+        self._selected = None
 
     def _write(self, cmd):
         self.isconnected()
-        Device._instance.write(cmd.encode())
+        self._buildhat.write(cmd.encode())
 
     def _write1(self, data):
         hexstr = ' '.join(f'{h:x}' for h in data)
@@ -282,9 +502,76 @@ class Device:
             self.deselect()
         if func is None:
             self._conn.callit = None
+            self._conn.filters = ()
         else:
+            self._apply_filters()
             self._conn.callit = weakref.WeakMethod(func)
 
+    def set_filters(self, *filters):
+        """Only pass data frames to the callback which get through every filter
+
+        Filters, such as those in buildhat.filters, run on the serial reader thread,
+        so frames which would be ignored never reach the callback thread. They are
+        tried in order, and a frame stops at the first filter it fails. Data returned
+        by get() is not filtered.
+
+        With no filters every frame is passed on. Until this is called, devices use
+        their own filters, such as the threshold of when_pressed or when_in_range.
+
+        :param filters: Functions called with time.monotonic() of the frame and its data,
+                        returning whether the frame should be passed on
+        """
+        self._filters = filters
+        if self._conn.callit is not None:
+            self._apply_filters()
+
+    @property
+    def filters(self):
+        """Filters applied to data frames before they are passed to the callback
+
+        :getter: Returns filters
+        :return: Tuple of filters
+        """
+        if self._filters is None:
+            return self._default_filters()
+        return tuple(self._filters)
+
+    def _default_filters(self):
+        return ()
+
+    def _apply_filters(self):
+        filters = self.filters
+        for filt in filters:
+            if hasattr(filt, "reset"):
+                filt.reset()
+        self._conn.filters = filters
+
+    def set_callback_policy(self, policy=CallbackPolicy.DROP_OLDEST, maxlen=CallbackDispatcher.DEFAULT_MAXLEN):
+        """Set how callback events are queued when the callback can't keep up
+
+        Each port delivers callbacks on its own thread, so a slow callback
+        only delays events from its own device
+
+        :param policy: CallbackPolicy.DROP_OLDEST to discard the oldest queued event, or
+                       CallbackPolicy.COALESCE to only keep the latest
+        :param maxlen: Number of events that can wait to be delivered
+        :raises DeviceError: Occurs if invalid policy or length passed
+        """
+        if not isinstance(policy, CallbackPolicy):
+            raise DeviceError("Invalid callback policy")
+        if not isinstance(maxlen, int) or maxlen < 1:
+            raise DeviceError("Invalid callback queue length")
+        self._hat.set_callback_policy(self.port, policy, maxlen)
+
+    @property
+    def callbacks_dropped(self):
+        """Number of callback events discarded because the queue was full
+
+        :return: Number of events
+        :rtype: int
+        """
+        return self._hat.dispatchers[self.port].dropped
+
     @property
     def interval(self):
         """Interval between data points in milliseconds
@@ -307,5 +594,7 @@ class Device:
         if isinstance(value, int) and value >= 0 and value <= 1000000000:
             self._interval = value
             self._write(f"port {self.port} ; selrate {self._interval}\r")
+            if self._selected is not None:
+                self._selected = self._selected[:2] + (value,)
         else:
             raise DeviceError("Invalid interval")
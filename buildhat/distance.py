@@ -1,61 +1,64 @@
 """Distance sensor handling functionality"""
 
-from threading import Condition
-
 from .devices import Device
 from .exc import DistanceSensorError
+from .filters import Threshold
 
 
 class DistanceSensor(Device):
     """Distance sensor
 
     :param port: Port of device
+    :param hat: Optional Hat the device is attached to, otherwise the first one
     :raises DeviceError: Occurs if there is no distance sensor attached to port
     """
 
-    def __init__(self, port, threshold_distance=100):
+    def __init__(self, port, threshold_distance=100, hat=None):
         """
         Initialise distance sensor
 
         :param port: Port of device
         :param threshold_distance: Optional
+        :param hat: Optional Hat the device is attached to, otherwise the first one
         """
-        super().__init__(port)
+        super().__init__(port, hat)
         self.on()
         self.mode(0)
-        self._cond_data = Condition()
         self._when_in_range = None
         self._when_out_of_range = None
         self._fired_in = False
         self._fired_out = False
         self._threshold_distance = threshold_distance
-        self._distance = -1
 
     def _intermediate(self, data):
-        self._distance = data[0]
-        if self._distance != -1 and self._distance < self.threshold_distance and not self._fired_in:
+        distance = data[0]
+        if distance != -1 and distance < self.threshold_distance and not self._fired_in:
             if self._when_in_range is not None:
                 self._when_in_range(data[0])
             self._fired_in = True
             self._fired_out = False
-        if self._distance != -1 and self._distance > self.threshold_distance and not self._fired_out:
+        if distance != -1 and distance > self.threshold_distance and not self._fired_out:
             if self._when_out_of_range is not None:
                 self._when_out_of_range(data[0])
             self._fired_in = False
             self._fired_out = True
-        with self._cond_data:
-            self._data = data[0]
-            self._cond_data.notify()
+
+    def _default_filters(self):
+        # Only frames where the distance crosses the threshold can fire an event
+        return (Threshold(self.threshold_distance, ignore=(-1,)),)
 
     @property
     def distance(self):
         """
-        Obtain previously stored distance
+        Obtain latest distance received, without waiting for the next reading
 
         :getter: Returns distance
-        :return: Stored distance
+        :return: Latest distance, or -1 if nothing received yet
         """
-        return self._distance
+        sample = self._conn.sample
+        if sample is None:
+            return -1
+        return sample[1][0]
 
     @property
     def threshold_distance(self):
@@ -71,6 +74,8 @@ class DistanceSensor(Device):
     @threshold_distance.setter
     def threshold_distance(self, value):
         self._threshold_distance = value
+        if self._conn.callit is not None:
+            self._apply_filters()
 
     def get_distance(self):
         """
@@ -127,22 +132,18 @@ class DistanceSensor(Device):
 
         :param distance: Distance
         """
-        self.callback(self._intermediate)
-        with self._cond_data:
-            self._cond_data.wait()
-            while self._data < distance:
-                self._cond_data.wait()
+        while self.get()[0] < distance:
+            pass
 
     def wait_for_in_range(self, distance):
         """Wait until object is closer than specified distance
 
         :param distance: Distance
         """
-        self.callback(self._intermediate)
-        with self._cond_data:
-            self._cond_data.wait()
-            while self._data == -1 or self._data > distance:
-                self._cond_data.wait()
+        while True:
+            data = self.get()[0]
+            if data != -1 and data <= distance:
+                break
 
     def eyes(self, *args):
         """
@@ -0,0 +1,154 @@
+"""Filters deciding which data frames reach a device's callback
+
+Filters are evaluated by the serial reader thread as each frame arrives,
+so frames which would be ignored anyway never reach the callback thread.
+A filter is called with the time.monotonic() of the frame and its values,
+and returns whether the frame should be passed on.
+"""
+
+
+class Deadband:
+    """Pass a frame when a value has changed by at least width since the last frame passed
+
+    :param width: Smallest change passed on
+    :param index: Optional index of value to compare, otherwise a change in any value is passed on
+    """
+
+    def __init__(self, width, index=None):
+        """Deadband filter
+
+        :param width: Smallest change passed on
+        :param index: Optional index of value to compare, otherwise a change in any value is passed on
+        """
+        self.width = width
+        self.index = index
+        self.reset()
+
+    def reset(self):
+        """Pass the next frame, whatever its values"""
+        self._last = None
+
+    def __call__(self, now, data):
+        """Filter frame
+
+        :param now: Time frame arrived
+        :param data: Values in frame
+        :return: Whether to pass frame on
+        """
+        last = self._last
+        if last is not None and len(last) == len(data):
+            if self.index is None:
+                if all(abs(a - b) < self.width for a, b in zip(data, last)):
+                    return False
+            elif abs(data[self.index] - last[self.index]) < self.width:
+                return False
+        self._last = data
+        return True
+
+
+class Threshold:
+    """Pass a frame when a value crosses a level
+
+    A value is below, at or above the level, and a frame is passed on
+    whenever that changes. The first frame is always passed on.
+
+    :param level: Level to compare value with
+    :param index: Optional index of value to compare
+    :param ignore: Optional values, such as -1 for no reading, which are never passed on
+    """
+
+    def __init__(self, level, index=0, ignore=()):
+        """Threshold filter
+
+        :param level: Level to compare value with
+        :param index: Optional index of value to compare
+        :param ignore: Optional values, such as -1 for no reading, which are never passed on
+        """
+        self.level = level
+        self.index = index
+        self.ignore = tuple(ignore)
+        self.reset()
+
+    def reset(self):
+        """Pass the next frame, whatever its values"""
+        self._side = None
+
+    def __call__(self, now, data):
+        """Filter frame
+
+        :param now: Time frame arrived
+        :param data: Values in frame
+        :return: Whether to pass frame on
+        """
+        value = data[self.index]
+        if value in self.ignore:
+            return False
+        side = (value > self.level) - (value < self.level)
+        if side == self._side:
+            return False
+        self._side = side
+        return True
+
+
+class Decimate:
+    """Pass every Nth frame
+
+    :param n: Number of frames for each one passed on
+    """
+
+    def __init__(self, n):
+        """Decimation filter
+
+        :param n: Number of frames for each one passed on
+        :raises ValueError: Occurs if n is not a positive integer
+        """
+        if not isinstance(n, int) or n < 1:
+            raise ValueError("n must be a positive integer")
+        self.n = n
+        self.reset()
+
+    def reset(self):
+        """Pass the next frame"""
+        self._count = 0
+
+    def __call__(self, now, data):
+        """Filter frame
+
+        :param now: Time frame arrived
+        :param data: Values in frame
+        :return: Whether to pass frame on
+        """
+        count = self._count
+        self._count = (count + 1) % self.n
+        return count == 0
+
+
+class MinInterval:
+    """Pass a frame when at least an interval has passed since the last frame passed
+
+    :param seconds: Shortest time between frames passed on
+    """
+
+    def __init__(self, seconds):
+        """Minimum interval filter
+
+        :param seconds: Shortest time between frames passed on
+        """
+        self.seconds = seconds
+        self.reset()
+
+    def reset(self):
+        """Pass the next frame"""
+        self._last = None
+
+    def __call__(self, now, data):
+        """Filter frame
+
+        :param now: Time frame arrived
+        :param data: Values in frame
+        :return: Whether to pass frame on
+        """
+        if self._last is not None and now - self._last < self.seconds:
+            return False
+        self._last = now
+        return True
@@ -1,36 +1,37 @@
 """Force sensor handling functionality"""
 
-from threading import Condition
-
 from .devices import Device
+from .filters import Threshold
 
 
 class ForceSensor(Device):
     """Force sensor
 
     :param port: Port of device
+    :param hat: Optional Hat the device is attached to, otherwise the first one
     :raises DeviceError: Occurs if there is no force sensor attached to port
     """
 
-    def __init__(self, port, threshold_force=1):
+    def __init__(self, port, threshold_force=1, hat=None):
         """Initialise force sensor
 
         :param port: Port of device
         :param threshold_force: Optional
+        :param hat: Optional Hat the device is attached to, otherwise the first one
         """
-        super().__init__(port)
+        super().__init__(port, hat)
         self.mode([(0, 0), (1, 0), (3, 0)])
         self._when_pressed = None
         self._when_released = None
         self._fired_pressed = False
         self._fired_released = False
-        self._cond_force = Condition()
         self._threshold_force = threshold_force
 
+    def _default_filters(self):
+        # Only frames where the force crosses the threshold can fire an event
+        return (Threshold(self.threshold_force),)
+
     def _intermediate(self, data):
-        with self._cond_force:
-            self._data = data[0]
-            self._cond_force.notify()
         if data[0] >= self.threshold_force and not self._fired_pressed:
             if self._when_pressed is not None:
                 self._when_pressed(data[0])
@@ -55,6 +56,8 @@ class ForceSensor(Device):
     @threshold_force.setter
     def threshold_force(self, value):
         self._threshold_force = value
+        if self._conn.callit is not None:
+            self._apply_filters()
 
     def get_force(self):
         """Return the force in (N)
@@ -125,19 +128,13 @@ class ForceSensor(Device):
 
         :param force: Optional
         """
-        self.callback(self._intermediate)
-        with self._cond_force:
-            self._cond_force.wait()
-            while self._data < force:
-                self._cond_force.wait()
+        while self.get()[0] < force:
+            pass
 
     def wait_until_released(self, force=0):
         """Wait until the button is released
 
         :param force: Optional
         """
-        self.callback(self._intermediate)
-        with self._cond_force:
-            self._cond_force.wait()
-            while self._data > force:
-                self._cond_force.wait()
+        while self.get()[0] > force:
+            pass
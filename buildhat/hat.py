@@ -1,69 +1,198 @@
 """HAT handling functionality"""
 
-from concurrent.futures import Future
-
 from .devices import Device
+from .exc import DeviceError
 
 
 class Hat:
-    """Allows enumeration of devices which are connected to the hat"""
+    """Allows enumeration of devices which are connected to the hat
+
+    Each serial device is a separate Build HAT, with its own threads and
+    ports A to D. Devices are attached to the first one unless given a hat::
+
+        h2 = Hat(device="/dev/ttyAMA1")
+        motor = Motor('A', hat=h2)
+    """
 
-    def __init__(self, device=None, debug=False):
+    def __init__(self, device=None, debug=False, trace=None):
         """Hat
 
-        :param device: Optional string containing path to Build HAT serial device
+        :param device: Optional string containing path to Build HAT serial device, or "unix:" followed by
+                       the path of a buildhatd socket. When not given, buildhatd is used if it is running,
+                       otherwise /dev/serial0. Hats for the same device share one connection. Firmware can
+                       only be updated through the reset pins of the board on /dev/serial0, so other boards
+                       should already be running the firmware, or be in their bootloader
         :param debug: Optional boolean to log debug information
+        :param trace: Optional path of a binary trace file recording all bytes sent and received, which is
+                      cheaper than debug logging and can be rendered with ``python3 -m buildhat.trace``
         """
         self.led_status = -1
-        if device is None:
-            Device._setup(debug=debug)
-        else:
-            Device._setup(device=device, debug=debug)
+        kwargs = {"debug": debug}
+        if device is not None:
+            kwargs["device"] = device
+        if trace is not None:
+            kwargs["trace"] = trace
+        self._buildhat = Device._setup(**kwargs)
 
-    def get(self):
+    def get(self, refresh=False, timeout=None):
         """Get devices which are connected or disconnected
 
+        :param refresh: Ask the firmware to list its devices again first, rather than
+                        relying on the messages it sends when devices are plugged in
+        :param timeout: Optional time in seconds to wait for the list when refreshing
         :return: Dictionary of devices
         :rtype: dict
+        :raises BuildHATError: Occurs if the timeout passes before the list
         """
+        if refresh:
+            self._buildhat.query("list", b"list\r", timeout)
         devices = {}
         for i in range(4):
             name = Device.UNKNOWN_DEVICE
-            if Device._instance.connections[i].typeid in Device._device_names:
-                name = Device._device_names[Device._instance.connections[i].typeid][0]
-                desc = Device._device_names[Device._instance.connections[i].typeid][1]
-            elif Device._instance.connections[i].typeid == -1:
+            if self._buildhat.connections[i].typeid in Device._device_names:
+                name = Device._device_names[self._buildhat.connections[i].typeid][0]
+                desc = Device._device_names[self._buildhat.connections[i].typeid][1]
+            elif self._buildhat.connections[i].typeid == -1:
                 name = Device.DISCONNECTED_DEVICE
                 desc = ''
-            devices[chr(ord('A') + i)] = {"typeid": Device._instance.connections[i].typeid,
-                                          "connected": Device._instance.connections[i].connected,
+            devices[chr(ord('A') + i)] = {"typeid": self._buildhat.connections[i].typeid,
+                                          "connected": self._buildhat.connections[i].connected,
                                           "name": name,
                                           "description": desc}
         return devices
 
+    def observe(self, port, func):
+        """Call a function with each data frame from a port, without claiming it
+
+        Frames arrive in whatever mode the device on the port was put in.
+        Through buildhatd, frames from a port claimed by another program are
+        forwarded too, so its sensors can be watched from here. The function
+        is called from the serial reader thread, so should return quickly.
+
+        :param port: Port, such as 'A'
+        :param func: Function called with time.monotonic() of the frame and its data, or None to stop
+        :raises DeviceError: Occurs if invalid port given
+        """
+        if not isinstance(port, str) or len(port) != 1 or not ('A' <= port <= 'D'):
+            raise DeviceError("Invalid port")
+        self._buildhat.observe(ord(port) - ord('A'), func)
+
     def get_logfile(self):
         """Get the filename of the debug log (If enabled, None otherwise)
 
         :return: Path of the debug logfile
         :rtype: str or None
         """
-        return Device._instance.debug_filename
+        return self._buildhat.debug_filename
 
-    def get_vin(self):
+    def get_vin(self, timeout=None):
         """Get the voltage present on the input power jack
 
+        :param timeout: Optional time in seconds to wait for a reply
+        :return: Voltage on the input power jack
+        :rtype: float
+        :raises BuildHATError: Occurs if the timeout passes before a reply
+        """
+        return self._buildhat.query("vin", b"vin\r", timeout)
+
+    async def get_vin_async(self, timeout=None):
+        """Get the voltage present on the input power jack, as a coroutine
+
+        Suits monitoring the battery periodically from a background task::
+
+            async def monitor(hat):
+                while True:
+                    print(await hat.get_vin_async(timeout=1))
+                    await asyncio.sleep(10)
+
+        :param timeout: Optional time in seconds to wait for a reply
         :return: Voltage on the input power jack
         :rtype: float
+        :raises BuildHATError: Occurs if the timeout passes before a reply
         """
-        ftr = Future()
-        Device._instance.vinftr.append(ftr)
-        Device._instance.write(b"vin\r")
-        return ftr.result()
+        return await self._buildhat.query_async("vin", b"vin\r", timeout)
+
+    def get_firmware_version(self, timeout=None):
+        """Get the version the firmware reports
+
+        :param timeout: Optional time in seconds to wait for a reply
+        :return: Version and build date, such as "1674818421 2023-01-27T11:20:21+00:00"
+        :rtype: str
+        :raises BuildHATError: Occurs if the timeout passes before a reply
+        """
+        return self._buildhat.query("version", b"version\r", timeout)
+
+    def get_startup_timings(self):
+        """Get how long each phase of startup took
+
+        Keys are phases such as "open", "probe", "firmware", "boot" and
+        "ready", values are seconds since startup began
+
+        :return: Dictionary of phase timings
+        :rtype: dict
+        """
+        return dict(self._buildhat.timings)
+
+    def stats(self):
+        """Get counters and histograms recorded by the serial interface
+
+        Includes lines and bytes read and written, in total and for each
+        port, time spent parsing each line, callback queue depths, how long
+        callbacks waited and ran for, frames dropped, and how long waits for
+        data, ramps, pulses and queries such as vin took. Useful for spotting a saturated
+        UART or slow callbacks, without enabling debug logging.
+
+        :return: Dictionary of stats
+        :rtype: dict
+        """
+        return self._buildhat.stats()
+
+    def serve_metrics(self, port=9100, addr=""):
+        """Serve stats() to Prometheus over HTTP, at /metrics
+
+        :param port: TCP port to listen on
+        :param addr: Optional address to listen on, otherwise all interfaces
+        :return: MetricsServer, whose close() stops serving
+        """
+        from .metrics import MetricsServer
+
+        return MetricsServer(self._buildhat.stats, port, addr)
+
+    def batch(self):
+        """Send all commands issued within a with block as a single line
+
+        Commands too long for one line are split between commands.
+        Useful for starting several motors in the same firmware tick::
+
+            with hat.batch():
+                motor_a.start(50)
+                motor_b.start(-50)
+
+        Nothing is sent until the block ends, so calls which wait for the
+        firmware, such as get_vin(), Device.get() or blocking motor moves,
+        raise BuildHATError within it.
+
+        :return: Context manager
+        """
+        return self._buildhat.batch()
+
+    def publish_snapshot(self, name=None):
+        """Publish the latest data from every port into shared memory
+
+        Other processes can then read it with buildhat.snapshot.SnapshotReader.
+        Only data from ports with a device in use is published.
+
+        :param name: Optional name of shared memory block
+        :return: SnapshotWriter, whose close() stops publishing
+        """
+        from .snapshot import DEFAULT_NAME, SnapshotWriter
+
+        return SnapshotWriter(self._buildhat, name if name is not None else DEFAULT_NAME)
 
     def _set_led(self, intmode):
         if isinstance(intmode, int) and intmode >= -1 and intmode <= 3:
             self.led_status = intmode
-            Device._instance.write(f"ledmode {intmode}\r".encode())
+            self._buildhat.write(f"ledmode {intmode}\r".encode())
 
     def set_leds(self, color="voltage"):
         """Set the two LEDs on or off on the BuildHAT.
@@ -127,4 +256,4 @@ class Hat:
                 self._set_led(1)
 
     def _close(self):
-        Device._instance.shutdown()
+        self._buildhat.shutdown()
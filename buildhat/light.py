@@ -10,16 +10,18 @@ class Light(Device):
     Use on()/off() functions to turn lights on/off
 
     :param port: Port of device
+    :param hat: Optional Hat the device is attached to, otherwise the first one
     :raises DeviceError: Occurs if there is no light attached to port
     """
 
-    def __init__(self, port):
+    def __init__(self, port, hat=None):
         """
         Initialise light
 
         :param port: Port of device
+        :param hat: Optional Hat the device is attached to, otherwise the first one
         """
-        super().__init__(port)
+        super().__init__(port, hat)
 
     def brightness(self, brightness):
         """
@@ -1,25 +1,206 @@
 """Matrix device handling functionality"""
 
+import threading
+import time
+import weakref
+
 from .devices import Device
 from .exc import MatrixError
 
 
+class MatrixFrame:
+    """Pixels for a LED matrix, validated and encoded once so they can be shown many times
+
+    :param matrix: 3x3 list of tuples, with colour (0–10) or string and brightness (0–10)
+    :raises MatrixError: Occurs if invalid matrix or pixel provided
+    """
+
+    def __init__(self, matrix):
+        """Encode frame
+
+        :param matrix: 3x3 list of tuples, with colour (0–10) or string and brightness (0–10)
+        :raises MatrixError: Occurs if invalid matrix or pixel provided
+        """
+        if len(matrix) != 3:
+            raise MatrixError("Incorrect matrix height")
+        pixels = []
+        for x in range(3):
+            if len(matrix[x]) != 3:
+                raise MatrixError("Incorrect matrix width")
+            pixels.append([Matrix.normalize_pixel(matrix[x][y]) for y in range(3)])  # pylint: disable=too-many-function-args
+        self.pixels = pixels
+        self.data = bytes([0xc2] + [(pixel[1] << 4) | pixel[0] for row in pixels for pixel in row])
+        self.cmd = "write1 " + " ".join(f"{h:x}" for h in self.data)
+
+
+class Animator:
+    """Shows sequences of frames on LED matrices at a fixed rate, from one thread
+
+    Frames are picked by the time since a sequence started, so a late
+    tick skips frames rather than slowing the animation down. Frames due
+    on several matrices of a Build HAT in the same tick are sent as one line.
+
+    :param fps: Frames per second
+    :raises MatrixError: Occurs if invalid rate provided
+    """
+
+    def __init__(self, fps=10):
+        """Create animator
+
+        :param fps: Frames per second
+        :raises MatrixError: Occurs if invalid rate provided
+        """
+        if not (fps > 0):
+            raise MatrixError("Invalid frame rate")
+        self.fps = fps
+        self._cond = threading.Condition()
+        self._playing = {}
+        self._th = None
+
+    def play(self, matrix, frames, loop=False):
+        """Start showing a sequence of frames on a matrix, replacing any it was showing
+
+        :param matrix: Matrix to show frames on
+        :param frames: List of MatrixFrame, or of 3x3 lists of pixels
+        :param loop: Whether to repeat the sequence until stopped
+        :raises MatrixError: Occurs if no frames or an invalid frame provided
+        """
+        frames = [f if isinstance(f, MatrixFrame) else MatrixFrame(f) for f in frames]
+        if len(frames) == 0:
+            raise MatrixError("No frames to play")
+        with self._cond:
+            self._playing[Animator._key(matrix)] = (weakref.ref(matrix), frames, loop, time.monotonic())
+            if self._th is None:
+                self._th = threading.Thread(target=self._run)
+                self._th.daemon = True
+                self._th.start()
+            self._cond.notify()
+
+    def stop(self, matrix=None):
+        """Stop showing frames, leaving the current frame displayed
+
+        :param matrix: Optional matrix to stop, otherwise every matrix is stopped
+        """
+        with self._cond:
+            if matrix is None:
+                stopped = list(self._playing.values())
+                self._playing.clear()
+            else:
+                key = Animator._key(matrix)
+                stopped = [self._playing.pop(key)] if key in self._playing else []
+            self._cond.notify()
+        for ref, _, _, _ in stopped:
+            m = ref()
+            if m is not None:
+                m.deselect()
+
+    def playing(self, matrix):
+        """Whether a matrix is showing a sequence
+
+        :param matrix: Matrix to check
+        :return: Whether a sequence is playing on the matrix
+        :rtype: bool
+        """
+        with self._cond:
+            return Animator._key(matrix) in self._playing
+
+    @staticmethod
+    def _key(matrix):
+        """Key of a matrix, as ports are only unique within one Build HAT
+
+        :param matrix: Matrix to find the key of
+        :return: Serial interface and port of the matrix
+        """
+        return (matrix._hat, matrix.port)
+
+    def wait(self):
+        """Wait until every sequence which doesn't loop has finished"""
+        with self._cond:
+            self._cond.wait_for(lambda: all(loop for _, _, loop, _ in self._playing.values()))
+
+    def _run(self):
+        period = 1 / self.fps
+        nexttick = time.monotonic()
+        while True:
+            with self._cond:
+                if len(self._playing) == 0:
+                    # Nothing to show, so let the thread go until play() is called again
+                    self._th = None
+                    return
+                now = time.monotonic()
+                due = []
+                finished = []
+                for key, (ref, frames, loop, start) in list(self._playing.items()):
+                    m = ref()
+                    idx = int((now - start) * self.fps + 1e-6)
+                    if m is None or (not loop and idx >= len(frames)):
+                        del self._playing[key]
+                        if m is not None:
+                            due.append((m, frames[-1]))
+                            finished.append(m)
+                    else:
+                        due.append((m, frames[idx % len(frames)]))
+                m = None
+                if len(finished) > 0:
+                    self._cond.notify_all()
+            self._tick(due, finished)
+            due = finished = None  # Necessary for 'del' to function correctly on matrix objects
+            nexttick += period
+            delay = nexttick - time.monotonic()
+            if delay > 0:
+                time.sleep(delay)
+            else:
+                nexttick = time.monotonic()
+
+    def _tick(self, due, finished):
+        failed = []
+        byhat = {}
+        for m, frame in due:
+            byhat.setdefault(m._hat, []).append((m, frame))
+        for hat, shown in byhat.items():
+            try:
+                with hat.batch():
+                    for m, frame in shown:
+                        try:
+                            m.show(frame)
+                        except Exception:
+                            failed.append(m)
+            except Exception:
+                # Line couldn't be sent, so every matrix on this Build HAT failed
+                failed.extend(m for m, _ in shown)
+        for m in finished:
+            try:
+                m.deselect()
+            except Exception:
+                pass
+        if len(failed) > 0:
+            # Matrix disconnected, so stop showing frames on it
+            with self._cond:
+                for m in failed:
+                    self._playing.pop(Animator._key(m), None)
+                self._cond.notify_all()
+
+
 class Matrix(Device):
     """LED Matrix
 
     :param port: Port of device
+    :param hat: Optional Hat the device is attached to, otherwise the first one
     :raises DeviceError: Occurs if there is no LED matrix attached to port
     """
 
-    def __init__(self, port):
+    def __init__(self, port, hat=None):
         """Initialise matrix
 
         :param port: Port of device
+        :param hat: Optional Hat the device is attached to, otherwise the first one
         """
-        super().__init__(port)
+        super().__init__(port, hat)
         self.on()
         self.mode(2)
         self._matrix = [[(0, 0) for x in range(3)] for y in range(3)]
+        self._shown = None
+        self._animator = None
 
     def set_pixels(self, matrix, display=True):
         """Write pixel data to LED matrix
@@ -44,9 +225,44 @@ class Matrix(Device):
         for x in range(3):
             for y in range(3):
                 out.append((self._matrix[x][y][1] << 4) | self._matrix[x][y][0])
-        self.select()
-        self._write1(out)
-        self.deselect()
+        hexstr = ' '.join(f'{h:x}' for h in out)
+        self._write(f"port {self.port} ; select 2 ; selrate {self._interval} ; write1 {hexstr} ; select\r")
+        self._selected = None
+        self._shown = (self._conn.generation, bytes(out))
+
+    def show(self, frame):
+        """Show a pre-encoded frame, if it differs from what is displayed
+
+        The port is left selected, so showing frames one after another only
+        sends the pixel data. Call deselect() once finished showing frames.
+
+        :param frame: MatrixFrame to show
+        """
+        shown = (self._conn.generation, frame.data)
+        if self._shown == shown:
+            return
+        self._write(f"port {self.port} ; {self._select_cmd(2)}{frame.cmd}\r")
+        self._shown = shown
+        self._matrix = [list(row) for row in frame.pixels]
+
+    def play(self, frames, fps=10, loop=False):
+        """Show a sequence of frames at a fixed rate, in the background
+
+        To keep several matrices in step, use one Animator for all of them
+
+        :param frames: List of MatrixFrame, or of 3x3 lists of pixels
+        :param fps: Frames per second
+        :param loop: Whether to repeat the sequence until stop_animation() is called
+        """
+        self.stop_animation()
+        if self._animator is None or self._animator.fps != fps:
+            self._animator = Animator(fps)
+        self._animator.play(self, frames, loop)
+
+    def stop_animation(self):
+        """Stop showing a sequence started by play()"""
+        if self._animator is not None:
+            self._animator.stop(self)
 
     @staticmethod
     def strtocolor(colorstr):
@@ -152,6 +368,7 @@ class Matrix(Device):
             raise MatrixError("Invalid level, not integer")
         if not (level >= 0 and level <= 9):
             raise MatrixError("Invalid level specified")
+        self._shown = None
         self.mode(0)
         self.select()
         self._write1([0xc0, level])
@@ -187,6 +404,7 @@ class Matrix(Device):
             raise MatrixError("Invalid transition, not integer")
         if not (transition >= 0 and transition <= 2):
             raise MatrixError("Invalid transition specified")
+        self._shown = None
         self.mode(3)
         self.select()
         self._write1([0xc3, transition])
@@ -0,0 +1,193 @@
+"""Lightweight counters and histograms recorded by the serial interface"""
+
+import threading
+import time
+from bisect import bisect_left
+
+# Upper bounds of histogram buckets, in seconds
+BUCKETS = (0.00001, 0.000025, 0.00005, 0.0001, 0.00025, 0.0005, 0.001, 0.0025,
+           0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1.0, 2.5, 5.0)
+
+
+class Histogram:
+    """Counts observations into fixed buckets, without keeping the observations"""
+
+    def __init__(self, bounds=BUCKETS):
+        """Initialise histogram
+
+        :param bounds: Ascending upper bounds of the buckets
+        """
+        self.bounds = tuple(bounds)
+        self.counts = [0] * (len(self.bounds) + 1)
+        self.count = 0
+        self.sum = 0.0
+        self.max = 0.0
+        self.lock = threading.Lock()
+
+    def observe(self, value):
+        """Record an observation
+
+        :param value: Value observed
+        """
+        with self.lock:
+            self.counts[bisect_left(self.bounds, value)] += 1
+            self.count += 1
+            self.sum += value
+            if value > self.max:
+                self.max = value
+
+    def quantile(self, q):
+        """Estimate a quantile, as the upper bound of the bucket it falls in
+
+        :param q: Quantile, between 0 and 1
+        :return: Upper bound, or the largest observation if beyond the last bucket
+        """
+        if self.count == 0:
+            return 0.0
+        rank = q * self.count
+        total = 0
+        for bound, count in zip(self.bounds, self.counts):
+            total += count
+            if total >= rank:
+                return min(bound, self.max)
+        return self.max
+
+    def stats(self):
+        """Summary of observations
+
+        :return: Dictionary of count, sum, max, p50, p99 and cumulative buckets
+        """
+        with self.lock:
+            counts = list(self.counts)
+            summary = {"count": self.count, "sum": self.sum, "max": self.max,
+                       "p50": self.quantile(0.5), "p99": self.quantile(0.99)}
+        buckets = []
+        total = 0
+        for bound, count in zip(self.bounds, counts):
+            total += count
+            buckets.append((bound, total))
+        summary["buckets"] = buckets
+        return summary
+
+
+class PortMetrics:
+    """Counters for one port, updated from the serial reader and writers"""
+
+    def __init__(self):
+        """Initialise counters"""
+        self.lines_in = 0
+        self.bytes_in = 0
+        self.frames = 0
+        self.stale = 0
+        self.filtered = 0
+        self.lines_out = 0
+        self.bytes_out = 0
+
+
+class Metrics:
+    """Counters and histograms for a Build HAT connection
+
+    Counters are plain integers incremented by the thread that owns them,
+    so recording costs little more than the increment.
+    """
+
+    def __init__(self):
+        """Initialise metrics"""
+        self.started = time.monotonic()
+        self.ports = [PortMetrics() for _ in range(4)]
+        self.lines_in = 0
+        self.bytes_in = 0
+        self.lines_out = 0
+        self.bytes_out = 0
+        self.parse = Histogram()
+
+    def command(self, data):
+        """Count a command before it is queued, against the port it selects
+
+        :param data: Command, such as b"port 0 ; select 0\r"
+        """
+        if data.startswith(b"port ") and len(data) > 5 and 48 <= data[5] <= 51:
+            port = self.ports[data[5] - 48]
+            port.lines_out += 1
+            port.bytes_out += len(data)
+
+
+def prometheus(stats, prefix="buildhat"):
+    """Format stats in the Prometheus text exposition format
+
+    :param stats: Dictionary returned by BuildHAT.stats()
+    :param prefix: Prefix of metric names
+    :return: Text of metrics
+    """
+    out = []
+
+    def metric(name, kind, samples):
+        out.append(f"# TYPE {prefix}_{name} {kind}")
+        for labels, value in samples:
+            out.append(f"{prefix}_{name}{labels} {value}")
+
+    def histogram(name, hists):
+        out.append(f"# TYPE {prefix}_{name} histogram")
+        for labels, hist in hists:
+            sep = labels[:-1] + "," if labels != "" else "{"
+            for bound, count in hist["buckets"]:
+                out.append(f'{prefix}_{name}_bucket{sep}le="{bound}"}} {count}')
+            out.append(f'{prefix}_{name}_bucket{sep}le="+Inf"}} {hist["count"]}')
+            out.append(f"{prefix}_{name}_sum{labels} {hist['sum']}")
+            out.append(f"{prefix}_{name}_count{labels} {hist['count']}")
+
+    metric("uptime_seconds", "gauge", [("", stats["uptime"])])
+    for key in ("lines_in", "bytes_in", "lines_out", "bytes_out"):
+        metric(f"{key}_total", "counter", [("", stats[key])])
+    metric("write_queue_depth", "gauge", [("", stats["write_queue"])])
+    histogram("parse_seconds", [("", stats["parse"])])
+    ports = [(f'{{port="{p["port"]}"}}', p) for p in stats["ports"]]
+    for key in ("lines_in", "bytes_in", "frames", "stale", "filtered", "lines_out", "bytes_out",
+                "callbacks_dropped", "motor_dropped"):
+        metric(f"port_{key}_total", "counter", [(labels, p[key]) for labels, p in ports])
+    for key in ("callback_queue", "callback_queue_max", "motor_queue"):
+        metric(f"port_{key}_depth", "gauge", [(labels, p[key]) for labels, p in ports])
+    for key in ("callback_wait", "callback_run", "data_wait", "ramp_wait", "pulse_wait"):
+        histogram(f"port_{key}_seconds", [(labels, p[key]) for labels, p in ports])
+    histogram("query_wait_seconds", [(f'{{query="{kind}"}}', hist) for kind, hist in stats["query_wait"].items()])
+    return "\n".join(out) + "\n"
+
+
+class MetricsServer:
+    """Serves stats to Prometheus over HTTP from a background thread"""
+
+    def __init__(self, source, port=9100, addr=""):
+        """Start serving metrics
+
+        :param source: Function returning the dictionary of stats
+        :param port: TCP port to listen on
+        :param addr: Optional address to listen on, otherwise all interfaces
+        """
+        from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+        class Handler(BaseHTTPRequestHandler):
+            def do_GET(self):
+                if self.path.split("?")[0] != "/metrics":
+                    self.send_error(404)
+                    return
+                body = prometheus(source()).encode()
+                self.send_response(200)
+                self.send_header("Content-Type", "text/plain; version=0.0.4")
+                self.send_header("Content-Length", str(len(body)))
+                self.end_headers()
+                self.wfile.write(body)
+
+            def log_message(self, format, *args):
+                pass
+
+        self.server = ThreadingHTTPServer((addr, port), Handler)
+        self.server.daemon_threads = True
+        self.port = self.server.server_address[1]
+        self.th = threading.Thread(target=self.server.serve_forever)
+        self.th.daemon = True
+        self.th.start()
+
+    def close(self):
+        """Stop serving metrics"""
+        self.server.shutdown()
+        self.server.server_close()
@@ -1,29 +1,31 @@
 """Motor device handling functionality"""
 
-import threading
 import time
 from collections import deque
-from concurrent.futures import Future
 from enum import Enum
 from threading import Condition
 
 from .devices import Device
 from .exc import MotorError
+from .filters import Deadband
+from .serinterface import Completion, MotorQueuePolicy
 
 
 class PassiveMotor(Device):
     """Passive Motor device
 
     :param port: Port of device
+    :param hat: Optional Hat the device is attached to, otherwise the first one
     :raises DeviceError: Occurs if there is no passive motor attached to port
     """
 
-    def __init__(self, port):
+    def __init__(self, port, hat=None):
         """Initialise motor
 
         :param port: Port of device
+        :param hat: Optional Hat the device is attached to, otherwise the first one
         """
-        super().__init__(port)
+        super().__init__(port, hat)
         self._default_speed = 20
         self._currentspeed = 0
         self.plimit(0.7)
@@ -93,31 +95,48 @@ class MotorRunmode(Enum):
     SECONDS = 3
 
 
+class PidMode(Enum):
+    """Controller used by a motor"""
+
+    POSITION = 0
+    SPEED = 1
+    RPM = 2
+
+
 class Motor(Device):
     """Motor device
 
     :param port: Port of device
+    :param hat: Optional Hat the device is attached to, otherwise the first one
     :raises DeviceError: Occurs if there is no motor attached to port
     """
 
-    def __init__(self, port):
+    DEFAULT_PID = {PidMode.POSITION: (5, 0, 0.1, 3, 0.01),
+                   PidMode.SPEED: (0.003, 0.01, 0, 100, 0.01),
+                   PidMode.RPM: (0, 2.5, 0, 0.4, 0.01)}
+
+    def __init__(self, port, hat=None):
         """Initialise motor
 
         :param port: Port of device
+        :param hat: Optional Hat the device is attached to, otherwise the first one
         """
-        super().__init__(port)
+        super().__init__(port, hat)
+        self._pid = dict(Motor.DEFAULT_PID)
+        self._pidsent = None
         self.default_speed = 20
         self._currentspeed = 0
-        if self._typeid in {38}:
-            self.mode([(1, 0), (2, 0)])
-            self._combi = "1 0 2 0"
-            self._noapos = True
-        else:
-            self.mode([(1, 0), (2, 0), (3, 0)])
-            self._combi = "1 0 2 0 3 0"
-            self._noapos = False
-        self.plimit(0.7)
-        self.pwmparams(0.65, 0.01)
+        with self._hat.batch():
+            if self._typeid in {38}:
+                self.mode([(1, 0), (2, 0)])
+                self._combi = "1 0 2 0"
+                self._noapos = True
+            else:
+                self.mode([(1, 0), (2, 0), (3, 0)])
+                self._combi = "1 0 2 0 3 0"
+                self._noapos = False
+            self.plimit(0.7)
+            self.pwmparams(0.65, 0.01)
         self._rpm = False
         self._release = True
         self._bqueue = deque(maxlen=5)
@@ -125,6 +144,7 @@ class Motor(Device):
         self.when_rotated = None
         self._oldpos = None
         self._runmode = MotorRunmode.NONE
+        self._queue_policy = MotorQueuePolicy.APPEND
 
     def set_speed_unit_rpm(self, rpm=False):
         """Set whether to use RPM for speed units or not
@@ -159,21 +179,31 @@ class Motor(Device):
                 raise MotorError("Invalid Speed")
             self.run_for_degrees(int(rotations * 360), speed, blocking)
 
-    def _run_for_degrees(self, degrees, speed):
-        self._runmode = MotorRunmode.DEGREES
+    def _degrees_target(self, pos, degrees, speed):
+        """Work out ramp to run for N degrees
+
+        :param pos: Current motor position in degrees (from preset position)
+        :param degrees: Number of degrees to rotate
+        :param speed: Speed ranging from -100 to 100
+        :return: Current and new position in decimal rotations, and unsigned speed
+        """
         mul = 1
         if speed < 0:
             speed = abs(speed)
             mul = -1
-        pos = self.get_position()
         newpos = ((degrees * mul) + pos) / 360.0
         pos /= 360.0
-        self._run_positional_ramp(pos, newpos, speed)
-        self._runmode = MotorRunmode.NONE
+        return pos, newpos, speed
 
-    def _run_to_position(self, degrees, speed, direction):
-        self._runmode = MotorRunmode.DEGREES
-        data = self.get()
+    def _position_target(self, data, degrees, direction):
+        """Work out ramp to run to position
+
+        :param data: Current data from motor
+        :param degrees: Position in degrees from -180 to 180
+        :param direction: shortest/clockwise/anticlockwise
+        :return: Current and new position in decimal rotations
+        :raises MotorError: Occurs if invalid direction passed
+        """
         pos = data[1]
         if self._noapos:
             apos = pos
@@ -197,30 +227,155 @@ class Motor(Device):
             raise MotorError("Invalid direction, should be: shortest, clockwise or anticlockwise")
         # Convert current motor position to decimal rotations from preset position to match newpos units
         pos /= 360.0
-        self._run_positional_ramp(pos, newpos, speed)
-        self._runmode = MotorRunmode.NONE
+        return pos, newpos
 
-    def _run_positional_ramp(self, pos, newpos, speed):
-        """Ramp motor
+    def _run_for_degrees(self, degrees, speed):
+        self._runmode = MotorRunmode.DEGREES
+        try:
+            pos, newpos, speed = self._degrees_target(self.get_position(), degrees, speed)
+            self._run_positional_ramp(pos, newpos, speed)
+        finally:
+            self._runmode = MotorRunmode.NONE
+
+    async def _run_for_degrees_async(self, degrees, speed):
+        self._runmode = MotorRunmode.DEGREES
+        try:
+            data = await self.get_async()
+            pos, newpos, speed = self._degrees_target(data[1], degrees, speed)
+            await self._run_positional_ramp_async(pos, newpos, speed)
+        finally:
+            self._runmode = MotorRunmode.NONE
+
+    def _run_to_position(self, degrees, speed, direction):
+        self._runmode = MotorRunmode.DEGREES
+        try:
+            pos, newpos = self._position_target(self.get(), degrees, direction)
+            self._run_positional_ramp(pos, newpos, speed)
+        finally:
+            self._runmode = MotorRunmode.NONE
+
+    async def _run_to_position_async(self, degrees, speed, direction):
+        self._runmode = MotorRunmode.DEGREES
+        try:
+            pos, newpos = self._position_target(await self.get_async(), degrees, direction)
+            await self._run_positional_ramp_async(pos, newpos, speed)
+        finally:
+            self._runmode = MotorRunmode.NONE
+
+    def set_pid(self, mode, kp, ki, kd, windup=None, deadzone=None):
+        """Set the gains of a PID controller, used by every following move
+
+        :param mode: PidMode.POSITION for moves by degrees or to a position, PidMode.SPEED
+                     for start and run_for_seconds, or PidMode.RPM for those when using RPM
+        :param kp: Proportional gain
+        :param ki: Integral gain
+        :param kd: Derivative gain
+        :param windup: Optional limit of integral term
+        :param deadzone: Optional error below which output is zero
+        :raises MotorError: Occurs if invalid mode passed
+        """
+        if not isinstance(mode, PidMode):
+            raise MotorError("Invalid PID mode")
+        default = Motor.DEFAULT_PID[mode]
+        self._pid[mode] = (kp, ki, kd,
+                           default[3] if windup is None else windup,
+                           default[4] if deadzone is None else deadzone)
+
+    def get_pid(self, mode):
+        """Get the gains of a PID controller
+
+        :param mode: PidMode of controller
+        :return: Tuple of kp, ki, kd, windup and deadzone
+        """
+        return self._pid[mode]
+
+    def reset_pid(self):
+        """Return every PID controller to its default gains"""
+        self._pid = dict(Motor.DEFAULT_PID)
+
+    def _pid_cmd(self, mode):
+        """Build command to set up a PID controller, unless already set up the same
+
+        :param mode: PidMode of controller
+        :return: Command string, empty if nothing needs sending
+        """
+        gains = ' '.join(str(g) for g in self._pid[mode])
+        if mode == PidMode.POSITION:
+            pid = f"pid {self.port} 0 1 s4 0.0027777778 0 {gains}"
+        elif mode == PidMode.SPEED:
+            pid = f"pid {self.port} 0 0 s1 1 0 {gains}"
+        else:
+            pid = f"pid_diff {self.port} 0 5 s2 0.0027777778 1 {gains}"
+        sent = (self._conn.generation, pid)
+        if self._pidsent == sent:
+            return ""
+        self._pidsent = sent
+        return f"{pid} ; "
+
+    def _forget_config(self):
+        """Forget what has been configured on the port, so it is sent again"""
+        super()._forget_config()
+        self._pidsent = None
+
+    def _ramp_setup(self):
+        """Build command to select data and PID parameters for a ramp
+
+        Only what has changed since the last move is included
+
+        :return: Command string without the port, to be followed by a ramp
+        """
+        return f"{self._select_cmd(0)}{self._pid_cmd(PidMode.POSITION)}"
+
+    def _ramp_start(self, pos, newpos, speed):
+        """Build command that starts a ramp, once set up
 
         :param pos: Current motor position in decimal rotations (from preset position)
         :param newpos: New motor postion in decimal rotations (from preset position)
         :param speed: -100 to 100
+        :return: Command string, without the port
         """
         if self._rpm:
             speed = self._speed_process(speed)
         else:
             speed *= 0.05  # Collapse speed range to -5 to 5
         dur = abs((newpos - pos) / speed)
-        cmd = (f"port {self.port}; select 0 ; selrate {self._interval}; "
-               f"pid {self.port} 0 1 s4 0.0027777778 0 5 0 .1 3 0.01; "
-               f"set ramp {pos} {newpos} {dur} 0\r")
-        ftr = Future()
-        self._hat.rampftr[self.port].append(ftr)
+        return f"set ramp {pos} {newpos} {dur} 0"
+
+    def _ramp_cmd(self, pos, newpos, speed):
+        """Build command to ramp motor
+
+        :param pos: Current motor position in decimal rotations (from preset position)
+        :param newpos: New motor postion in decimal rotations (from preset position)
+        :param speed: -100 to 100
+        :return: Command string
+        """
+        return f"port {self.port} ; {self._ramp_setup()}{self._ramp_start(pos, newpos, speed)}\r"
+
+    def _run_positional_ramp(self, pos, newpos, speed):
+        """Ramp motor
+
+        :param pos: Current motor position in decimal rotations (from preset position)
+        :param newpos: New motor postion in decimal rotations (from preset position)
+        :param speed: -100 to 100
+        """
+        cmd = self._ramp_cmd(pos, newpos, speed)
+        done = self._hat.rampdone[self.port]
+        token = done.token()
+        self._write(cmd)
+        done.wait(token)
+        if self._release and self._hat.motorqueue[self.port].pause(0.2):
+            self.coast()
+
+    async def _run_positional_ramp_async(self, pos, newpos, speed):
+        cmd = self._ramp_cmd(pos, newpos, speed)
+        done = self._hat.rampdone[self.port]
+        token = done.token()
         self._write(cmd)
-        ftr.result()
+        await done.wait_async(token)
         if self._release:
-            time.sleep(0.2)
+            import asyncio
+
+            await asyncio.sleep(0.2)
             self.coast()
 
     def run_for_degrees(self, degrees, speed=None, blocking=True):
@@ -266,23 +421,58 @@ class Motor(Device):
             self._wait_for_nonblocking()
             self._run_to_position(degrees, speed, direction)
 
+    def _pulse_setup(self):
+        """Build command to select data and PID parameters for a pulse
+
+        Only what has changed since the last move is included
+
+        :return: Command string without the port, to be followed by a pulse
+        """
+        return f"{self._select_cmd(0)}{self._pid_cmd(PidMode.RPM if self._rpm else PidMode.SPEED)}"
+
+    def _pulse_start(self, seconds, speed):
+        """Build command that starts a pulse, once set up
+
+        :param seconds: Time in seconds
+        :param speed: Speed ranging from -100 to 100
+        :return: Command string, without the port
+        """
+        return f"set pulse {self._speed_process(speed)} 0.0 {seconds} 0"
+
+    def _pulse_cmd(self, seconds, speed):
+        """Build command to run motor for N seconds
+
+        :param seconds: Time in seconds
+        :param speed: Speed ranging from -100 to 100
+        :return: Command string
+        """
+        return f"port {self.port} ; {self._pulse_setup()}{self._pulse_start(seconds, speed)}\r"
+
     def _run_for_seconds(self, seconds, speed):
-        speed = self._speed_process(speed)
         self._runmode = MotorRunmode.SECONDS
-        if self._rpm:
-            pid = f"pid_diff {self.port} 0 5 s2 0.0027777778 1 0 2.5 0 .4 0.01; "
-        else:
-            pid = f"pid {self.port} 0 0 s1 1 0 0.003 0.01 0 100 0.01;"
-        cmd = (f"port {self.port} ; select 0 ; selrate {self._interval}; "
-               f"{pid}"
-               f"set pulse {speed} 0.0 {seconds} 0\r")
-        ftr = Future()
-        self._hat.pulseftr[self.port].append(ftr)
-        self._write(cmd)
-        ftr.result()
-        if self._release:
-            self.coast()
-        self._runmode = MotorRunmode.NONE
+        try:
+            cmd = self._pulse_cmd(seconds, speed)
+            done = self._hat.pulsedone[self.port]
+            token = done.token()
+            self._write(cmd)
+            done.wait(token)
+            if self._release:
+                self.coast()
+        finally:
+            self._runmode = MotorRunmode.NONE
+
+    async def _run_for_seconds_async(self, seconds, speed):
+        self._runmode = MotorRunmode.SECONDS
+        try:
+            cmd = self._pulse_cmd(seconds, speed)
+            done = self._hat.pulsedone[self.port]
+            token = done.token()
+            self._write(cmd)
+            await done.wait_async(token)
+            if self._release:
+                self.coast()
+        finally:
+            self._runmode = MotorRunmode.NONE
 
     def run_for_seconds(self, seconds, speed=None, blocking=True):
         """Run motor for N seconds
@@ -303,6 +493,182 @@ class Motor(Device):
             self._wait_for_nonblocking()
             self._run_for_seconds(seconds, speed)
 
+    async def run_for_degrees_async(self, degrees, speed=None):
+        """Run motor for N degrees, as a coroutine
+
+        Unlike run_for_degrees(), doesn't wait for queued non-blocking commands
+
+        :param degrees: Number of degrees to rotate
+        :param speed: Speed ranging from -100 to 100
+        :raises MotorError: Occurs if invalid speed passed
+        """
+        if speed is None:
+            speed = self.default_speed
+        if not (speed >= -100 and speed <= 100):
+            raise MotorError("Invalid Speed")
+        await self._run_for_degrees_async(degrees, speed)
+
+    async def run_for_rotations_async(self, rotations, speed=None):
+        """Run motor for N rotations, as a coroutine
+
+        :param rotations: Number of rotations
+        :param speed: Speed ranging from -100 to 100
+        :raises MotorError: Occurs if invalid speed passed
+        """
+        await self.run_for_degrees_async(int(rotations * 360), speed)
+
+    async def run_to_position_async(self, degrees, speed=None, direction="shortest"):
+        """Run motor to position (in degrees), as a coroutine
+
+        Unlike run_to_position(), doesn't wait for queued non-blocking commands
+
+        :param degrees: Position in degrees from -180 to 180
+        :param speed: Speed ranging from 0 to 100
+        :param direction: shortest (default)/clockwise/anticlockwise
+        :raises MotorError: Occurs if invalid speed or angle passed
+        """
+        if speed is None:
+            speed = self.default_speed
+        if not (speed >= 0 and speed <= 100):
+            raise MotorError("Invalid Speed")
+        if degrees < -180 or degrees > 180:
+            raise MotorError("Invalid angle")
+        await self._run_to_position_async(degrees, speed, direction)
+
+    async def run_for_seconds_async(self, seconds, speed=None):
+        """Run motor for N seconds, as a coroutine
+
+        Unlike run_for_seconds(), doesn't wait for queued non-blocking commands
+
+        :param seconds: Time in seconds
+        :param speed: Speed ranging from -100 to 100
+        :raises MotorError: Occurs when invalid speed specified
+        """
+        if speed is None:
+            speed = self.default_speed
+        if not (speed >= -100 and speed <= 100):
+            raise MotorError("Invalid Speed")
+        await self._run_for_seconds_async(seconds, speed)
+
+    def _trajectory_segments(self, pos, waypoints, speed):
+        """Work out a ramp for each segment of a trajectory
+
+        :param pos: Current motor position in degrees (from preset position)
+        :param waypoints: Positions in degrees, or (position, speed) tuples
+        :param speed: Speed ranging from 0 to 100, for waypoints without their own
+        :return: List of current and new position in decimal rotations, and speed, for each segment
+        :raises MotorError: Occurs if invalid speed passed
+        """
+        segments = []
+        for waypoint in waypoints:
+            if isinstance(waypoint, (list, tuple)):
+                degrees, segspeed = waypoint
+            else:
+                degrees, segspeed = waypoint, speed
+            if not (segspeed > 0 and segspeed <= 100):
+                raise MotorError("Invalid Speed")
+            if degrees != pos:
+                segments.append((pos / 360.0, degrees / 360.0, segspeed))
+            pos = degrees
+        return segments
+
+    def _start_trajectory(self, waypoints, speed):
+        """Start the first segment of a trajectory, with the rest following on from it
+
+        Each time the firmware reports the ramp is done, the next segment is
+        sent from the serial reader thread, so the motor doesn't stop between
+        segments.
+
+        :param waypoints: Positions in degrees, or (position, speed) tuples
+        :param speed: Speed for waypoints without their own
+        :return: Completion set when the last segment is done, and its token
+        """
+        self._runmode = MotorRunmode.DEGREES
+        segments = self._trajectory_segments(self.get_position(), waypoints, speed)
+        finished = Completion()
+        token = finished.token()
+        if len(segments) == 0:
+            finished.set()
+            return finished, token
+        remaining = iter(segments[1:])
+        rampdone = self._hat.rampdone[self.port]
+
+        def advance(value, error):
+            if error is not None:
+                finished.fail(error)
+                return
+            seg = next(remaining, None)
+            if seg is None:
+                finished.set()
+                return
+            try:
+                rampdone.add_callback(advance)
+                self._write(f"port {self.port} ; {self._ramp_start(*seg)}\r")
+            except Exception as e:
+                finished.fail(e)
+
+        rampdone.add_callback(advance, rampdone.token())
+        self._write(f"port {self.port} ; {self._ramp_setup()}{self._ramp_start(*segments[0])}\r")
+        return finished, token
+
+    def _run_trajectory(self, waypoints, speed):
+        try:
+            finished, token = self._start_trajectory(waypoints, speed)
+            finished.wait(token)
+            if self._release and self._hat.motorqueue[self.port].pause(0.2):
+                self.coast()
+        finally:
+            self._runmode = MotorRunmode.NONE
+
+    async def _run_trajectory_async(self, waypoints, speed):
+        try:
+            finished, token = self._start_trajectory(waypoints, speed)
+            await finished.wait_async(token)
+            if self._release:
+                import asyncio
+
+                await asyncio.sleep(0.2)
+                self.coast()
+        finally:
+            self._runmode = MotorRunmode.NONE
+
+    def run_trajectory(self, waypoints, speed=None, blocking=True):
+        """Run motor through a sequence of positions without stopping between them
+
+        For example, run_trajectory([90, (180, 50), 0]) moves to 90 degrees
+        at the default speed, on to 180 degrees at speed 50, then back to 0
+
+        :param waypoints: Positions in degrees from preset position, or (position, speed) tuples
+        :param speed: Speed ranging from 0 to 100, for waypoints without their own
+        :param blocking: Whether call should block till finished
+        :raises MotorError: Occurs if invalid speed passed
+        """
+        if speed is None:
+            speed = self.default_speed
+        waypoints = list(waypoints)
+        # Check before queueing, so errors are raised here
+        self._trajectory_segments(0, waypoints, speed)
+        if not blocking:
+            self._queue((self._run_trajectory, (waypoints, speed)))
+        else:
+            self._wait_for_nonblocking()
+            self._run_trajectory(waypoints, speed)
+
+    async def run_trajectory_async(self, waypoints, speed=None):
+        """Run motor through a sequence of positions without stopping, as a coroutine
+
+        Unlike run_trajectory(), doesn't wait for queued non-blocking commands
+
+        :param waypoints: Positions in degrees from preset position, or (position, speed) tuples
+        :param speed: Speed ranging from 0 to 100, for waypoints without their own
+        :raises MotorError: Occurs if invalid speed passed
+        """
+        if speed is None:
+            speed = self.default_speed
+        waypoints = list(waypoints)
+        self._trajectory_segments(0, waypoints, speed)
+        await self._run_trajectory_async(waypoints, speed)
+
     def start(self, speed=None):
         """Start motor
 
@@ -326,13 +692,7 @@ class Motor(Device):
         speed = self._speed_process(speed)
         cmd = f"port {self.port} ; set {speed}\r"
         if self._runmode == MotorRunmode.NONE:
-            if self._rpm:
-                pid = f"pid_diff {self.port} 0 5 s2 0.0027777778 1 0 2.5 0 .4 0.01; "
-            else:
-                pid = f"pid {self.port} 0 0 s1 1 0 0.003 0.01 0 100 0.01; "
-            cmd = (f"port {self.port} ; select 0 ; selrate {self._interval}; "
-                   f"{pid}"
-                   f"set {speed}\r")
+            cmd = f"port {self.port} ; {self._pulse_setup()}set {speed}\r"
         self._runmode = MotorRunmode.FREE
         self._currentspeed = speed
         self._write(cmd)
@@ -344,32 +704,35 @@ class Motor(Device):
         self._currentspeed = 0
         self.coast()
 
-    def get_position(self):
+    def get_position(self, fresh=True):
         """Get position of motor with relation to preset position (can be negative or positive)
 
+        :param fresh: Wait for the next reading, rather than returning the latest received
         :return: Position of motor in degrees from preset position
         :rtype: int
         """
-        return self.get()[1]
+        return self.get(fresh)[1]
 
-    def get_aposition(self):
+    def get_aposition(self, fresh=True):
         """Get absolute position of motor
 
+        :param fresh: Wait for the next reading, rather than returning the latest received
         :return: Absolute position of motor from -180 to 180
         :rtype: int
         """
         if self._noapos:
             raise MotorError("No absolute position with this motor")
         else:
-            return self.get()[2]
+            return self.get(fresh)[2]
 
-    def get_speed(self):
+    def get_speed(self, fresh=True):
         """Get speed of motor
 
+        :param fresh: Wait for the next reading, rather than returning the latest received
         :return: Speed of motor
         :rtype: int
         """
-        return self.get()[0]
+        return self.get(fresh)[0]
 
     @property
     def when_rotated(self):
@@ -382,6 +745,10 @@ class Motor(Device):
         """
         return self._when_rotated
 
+    def _default_filters(self):
+        # Only frames where the position has moved can fire when_rotated
+        return (Deadband(1, index=1),)
+
     def _intermediate(self, data):
         if self._noapos:
             speed, pos = data
@@ -403,6 +770,13 @@ class Motor(Device):
         :param value: Callback function
         """
         self._when_rotated = value
+        if value is None:
+            # Nothing to call, so frames needn't be queued for the callback thread,
+            # but stay selected for get()
+            self._conn.callit = None
+            self._conn.filters = ()
+            return
+        self._oldpos = None
         self.callback(self._intermediate)
 
     def plimit(self, plimit):
@@ -447,10 +821,12 @@ class Motor(Device):
         if not (pwmv >= -1 and pwmv <= 1):
             raise MotorError("pwm should be -1 to 1")
         self._write(f"port {self.port} ; pwm ; set {pwmv}\r")
+        self._pidsent = None
 
     def coast(self):
         """Coast motor"""
         self._write(f"port {self.port} ; coast\r")
+        self._pidsent = None
 
     def float(self):
         """Float motor"""
@@ -478,12 +854,52 @@ class Motor(Device):
             raise MotorError("Must pass boolean")
         self._release = value
 
+    @property
+    def queue_policy(self):
+        """How a new command treats non-blocking commands queued before it
+
+        APPEND runs commands one after another. REPLACE discards commands not
+        yet started, so only the newest is run next. PREEMPT also interrupts
+        the running command, so the newest target takes effect straight away.
+        Blocking commands, start() and stop() follow the same policy.
+
+        :getter: Returns queue policy
+        :setter: Sets queue policy
+        :return: MotorQueuePolicy
+        """
+        return self._queue_policy
+
+    @queue_policy.setter
+    def queue_policy(self, value):
+        """Set how a new command treats non-blocking commands queued before it
+
+        :param value: MotorQueuePolicy
+        :raises MotorError: Occurs if invalid policy passed
+        """
+        if not isinstance(value, MotorQueuePolicy):
+            raise MotorError("Invalid queue policy")
+        self._queue_policy = value
+
+    def _preempt(self):
+        """Stop the running non-blocking command waiting for its ramp or pulse to finish"""
+        err = MotorError("Motor command preempted")
+        self._hat.rampdone[self.port].fail(err)
+        self._hat.pulsedone[self.port].fail(err)
+
     def _queue(self, cmd):
-        Device._instance.motorqueue[self.port].put(cmd)
+        if self._hat.motorqueue[self.port].put(cmd, self._queue_policy):
+            self._preempt()
 
     def _wait_for_nonblocking(self):
-        """Wait for nonblocking commands to finish"""
-        Device._instance.motorqueue[self.port].join()
+        """Wait for nonblocking commands to finish, or cut them short, depending on queue_policy"""
+        queue = self._hat.motorqueue[self.port]
+        dropped = queue.dropped
+        if queue.discard(self._queue_policy):
+            self._preempt()
+        queue.join()
+        if queue.dropped != dropped and self._runmode != MotorRunmode.FREE:
+            # Discarded before they ran, so nothing is left to clear the mode they set
+            self._runmode = MotorRunmode.NONE
 
     def _speed_process(self, speed):
         """Lower speed value"""
@@ -493,23 +909,272 @@ class Motor(Device):
             return speed
 
 
+class MotorGroup:
+    """Group of 2 to 4 motors, moved together
+
+    The positions of all the motors are read together, and the command
+    starting each motor is sent in a single line, so the firmware starts
+    them in the same tick. Waits for the motors to finish without creating
+    threads.
+
+    :param ports: Ports of the motors, such as 'A', 'B'
+    :param hat: Optional Hat the motors are attached to, otherwise the first one
+    :raises MotorError: Occurs if fewer than 2 or more than 4 ports given
+    :raises DeviceError: Occurs if there is no motor attached to a port
+    """
+
+    def __init__(self, *ports, hat=None):
+        """Initialise group of motors
+
+        :param ports: Ports of the motors, such as 'A', 'B'
+        :param hat: Optional Hat the motors are attached to, otherwise the first one
+        :raises MotorError: Occurs if fewer than 2 or more than 4 ports given
+        """
+        if len(ports) < 2 or len(ports) > 4:
+            raise MotorError("A group needs 2 to 4 motors")
+        self._motors = tuple(Motor(port, hat) for port in ports)
+        self._hat = self._motors[0]._hat
+        self.default_speed = 20
+        self._release = True
+        self._rpm = False
+
+    @property
+    def motors(self):
+        """Motors in group
+
+        :return: Motors, in the order their ports were given
+        :rtype: tuple
+        """
+        return self._motors
+
+    def set_default_speed(self, default_speed):
+        """Set the default speed of the motors
+
+        :param default_speed: Speed ranging from -100 to 100
+        """
+        self.default_speed = default_speed
+
+    def set_speed_unit_rpm(self, rpm=False):
+        """Set whether to use RPM for speed units or not
+
+        :param rpm: Boolean to determine whether to use RPM for units
+        """
+        self._rpm = rpm
+        for motor in self._motors:
+            motor.set_speed_unit_rpm(rpm)
+
+    def _each(self, value, name):
+        """Expand a value given for the whole group to one per motor
+
+        :param value: Single value, or sequence of one value per motor
+        :param name: What the value is, for the error message
+        :return: List of values
+        :raises MotorError: Occurs if the number of values doesn't match the number of motors
+        """
+        if isinstance(value, (list, tuple)):
+            if len(value) != len(self._motors):
+                raise MotorError(f"Need one {name} per motor")
+            return list(value)
+        return [value] * len(self._motors)
+
+    def _speeds(self, speeds, low=-100):
+        if speeds is None:
+            speeds = self.default_speed
+        speeds = self._each(speeds, "speed")
+        for speed in speeds:
+            if speed is None or not (speed >= low and speed <= 100):
+                raise MotorError("Invalid Speed")
+        return speeds
+
+    def _get_all(self):
+        """Wait for the next data from every motor, at the same time
+
+        :return: List of data, one per motor
+        """
+        waits = []
+        for motor in self._motors:
+            motor.isconnected()
+            done = self._hat.datadone[motor.port]
+            waits.append((done, done.token()))
+        return [done.wait(token) for done, token in waits]
+
+    def _start_all(self, setups, starts, completions):
+        """Send the set up for every motor, then start them all in one line
+
+        :param setups: Set up command for each motor
+        :param starts: Start command for each motor, without the port
+        :param completions: Completion set when each motor finishes
+        :return: Completions with their tokens
+        """
+        waits = []
+        for motor, done in zip(self._motors, completions):
+            motor._wait_for_nonblocking()
+            waits.append((done, done.token()))
+        with self._hat.batch():
+            for motor, setup in zip(self._motors, setups):
+                if setup != "":
+                    motor._write(f"port {motor.port} ; {setup}\r")
+        # Kept short, so all the motors start from one line
+        with self._hat.batch():
+            for motor, start in zip(self._motors, starts):
+                motor._write(f"port {motor.port} ; {start}\r")
+        return waits
+
+    def _run_all(self, setups, starts, completions, delay):
+        """Start every motor, and wait for them all to finish
+
+        :param setups: Commands setting up each motor, without the port
+        :param starts: Commands starting each motor, without the port
+        :param completions: Completion set when each motor finishes
+        :param delay: Seconds to wait before releasing the motors
+        """
+        try:
+            waits = self._start_all(setups, starts, completions)
+            for done, token in waits:
+                done.wait(token)
+            if self._release:
+                time.sleep(delay)
+                with self._hat.batch():
+                    for motor in self._motors:
+                        motor.coast()
+        finally:
+            for motor in self._motors:
+                motor._runmode = MotorRunmode.NONE
+
+    def _run_ramps(self, targets, speeds):
+        """Ramp every motor, and wait for them all to finish
+
+        :param targets: Current and new position, in decimal rotations, for each motor
+        :param speeds: Speed for each motor
+        """
+        setups = []
+        starts = []
+        for motor, (pos, newpos), speed in zip(self._motors, targets, speeds):
+            motor._runmode = MotorRunmode.DEGREES
+            setups.append(motor._ramp_setup())
+            starts.append(motor._ramp_start(pos, newpos, speed))
+        self._run_all(setups, starts, [self._hat.rampdone[m.port] for m in self._motors], 0.2)
+
+    def run_for_degrees(self, degrees, speeds=None):
+        """Run motors for N degrees
+
+        :param degrees: Number of degrees, or a list of one per motor
+        :param speeds: Speed ranging from -100 to 100, or a list of one per motor
+        :raises MotorError: Occurs if invalid speed passed
+        """
+        degrees = self._each(degrees, "degrees")
+        speeds = self._speeds(speeds)
+        targets = []
+        unsigned = []
+        for motor, data, deg, speed in zip(self._motors, self._get_all(), degrees, speeds):
+            pos, newpos, speed = motor._degrees_target(data[1], deg, speed)
+            targets.append((pos, newpos))
+            unsigned.append(speed)
+        self._run_ramps(targets, unsigned)
+
+    def run_for_rotations(self, rotations, speeds=None):
+        """Run motors for N rotations
+
+        :param rotations: Number of rotations, or a list of one per motor
+        :param speeds: Speed ranging from -100 to 100, or a list of one per motor
+        :raises MotorError: Occurs if invalid speed passed
+        """
+        self.run_for_degrees([int(r * 360) for r in self._each(rotations, "rotations")], speeds)
+
+    def run_to_position(self, degrees, speed=None, direction="shortest"):
+        """Run motors to position (in degrees)
+
+        :param degrees: Position in degrees from -180 to 180, or a list of one per motor
+        :param speed: Speed ranging from 0 to 100, or a list of one per motor
+        :param direction: shortest (default)/clockwise/anticlockwise
+        :raises MotorError: Occurs if invalid speed or angle passed
+        """
+        degrees = self._each(degrees, "position")
+        speeds = self._speeds(speed, 0)
+        for deg in degrees:
+            if deg < -180 or deg > 180:
+                raise MotorError("Invalid angle")
+        targets = [motor._position_target(data, deg, direction)
+                   for motor, data, deg in zip(self._motors, self._get_all(), degrees)]
+        self._run_ramps(targets, speeds)
+
+    def run_for_seconds(self, seconds, speeds=None):
+        """Run motors for N seconds
+
+        :param seconds: Time in seconds
+        :param speeds: Speed ranging from -100 to 100, or a list of one per motor
+        :raises MotorError: Occurs if invalid speed passed
+        """
+        speeds = self._speeds(speeds)
+        setups = []
+        starts = []
+        for motor, speed in zip(self._motors, speeds):
+            motor._runmode = MotorRunmode.SECONDS
+            setups.append(motor._pulse_setup())
+            starts.append(motor._pulse_start(seconds, speed))
+        self._run_all(setups, starts, [self._hat.pulsedone[m.port] for m in self._motors], 0)
+
+    def start(self, speeds=None):
+        """Start motors
+
+        :param speeds: Speed ranging from -100 to 100, or a list of one per motor
+        :raises MotorError: Occurs if invalid speed passed
+        """
+        speeds = self._speeds(speeds)
+        with self._hat.batch():
+            for motor, speed in zip(self._motors, speeds):
+                motor.start(speed)
+
+    def stop(self):
+        """Stop motors"""
+        with self._hat.batch():
+            for motor in self._motors:
+                motor.stop()
+
+    @property
+    def release(self):
+        """Determine if motors are released after running, so can be turned by hand
+
+        :getter: Returns whether motors are released, so can be turned by hand
+        :setter: Sets whether motors are released, so can be turned by hand
+        :return: Whether motors are released, so can be turned by hand
+        :rtype: bool
+        """
+        return self._release
+
+    @release.setter
+    def release(self, value):
+        """Determine if motors are released after running, so can be turned by hand
+
+        :param value: Whether motors should be released, so can be turned by hand
+        :type value: bool
+        """
+        if not isinstance(value, bool):
+            raise MotorError("Must pass boolean")
+        self._release = value
+        for motor in self._motors:
+            motor.release = value
+
+
 class MotorPair:
     """Pair of motors
 
     :param motora: One of the motors to drive
     :param motorb: Other motor in pair to drive
+    :param hat: Optional Hat the motors are attached to, otherwise the first one
     :raises DeviceError: Occurs if there is no motor attached to port
     """
 
-    def __init__(self, leftport, rightport):
+    def __init__(self, leftport, rightport, hat=None):
         """Initialise pair of motors
 
         :param leftport: Left motor port
         :param rightport:  Right motor port
+        :param hat: Optional Hat the motors are attached to, otherwise the first one
         """
         super().__init__()
-        self._leftmotor = Motor(leftport)
-        self._rightmotor = Motor(rightport)
+        self._group = MotorGroup(leftport, rightport, hat=hat)
+        self._leftmotor, self._rightmotor = self._group.motors
         self.default_speed = 20
         self._release = True
         self._rpm = False
@@ -527,8 +1192,7 @@ class MotorPair:
         :param rpm: Boolean to determine whether to use RPM for units
         """
         self._rpm = rpm
-        self._leftmotor.set_speed_unit_rpm(rpm)
-        self._rightmotor.set_speed_unit_rpm(rpm)
+        self._group.set_speed_unit_rpm(rpm)
 
     def run_for_rotations(self, rotations, speedl=None, speedr=None):
         """Run pair of motors for N rotations
@@ -554,14 +1218,7 @@ class MotorPair:
             speedl = self.default_speed
         if speedr is None:
             speedr = self.default_speed
-        th1 = threading.Thread(target=self._leftmotor._run_for_degrees, args=(degrees, speedl))
-        th2 = threading.Thread(target=self._rightmotor._run_for_degrees, args=(degrees, speedr))
-        th1.daemon = True
-        th2.daemon = True
-        th1.start()
-        th2.start()
-        th1.join()
-        th2.join()
+        self._group.run_for_degrees(degrees, [speedl, speedr])
 
     def run_for_seconds(self, seconds, speedl=None, speedr=None):
         """Run pair for N seconds
@@ -574,14 +1231,7 @@ class MotorPair:
             speedl = self.default_speed
         if speedr is None:
             speedr = self.default_speed
-        th1 = threading.Thread(target=self._leftmotor._run_for_seconds, args=(seconds, speedl))
-        th2 = threading.Thread(target=self._rightmotor._run_for_seconds, args=(seconds, speedr))
-        th1.daemon = True
-        th2.daemon = True
-        th1.start()
-        th2.start()
-        th1.join()
-        th2.join()
+        self._group.run_for_seconds(seconds, [speedl, speedr])
 
     def start(self, speedl=None, speedr=None):
         """Start motors
@@ -593,34 +1243,27 @@ class MotorPair:
             speedl = self.default_speed
         if speedr is None:
             speedr = self.default_speed
-        self._leftmotor.start(speedl)
-        self._rightmotor.start(speedr)
+        self._group.start([speedl, speedr])
 
     def stop(self):
         """Stop motors"""
-        self._leftmotor.stop()
-        self._rightmotor.stop()
+        self._group.stop()
 
     def run_to_position(self, degreesl, degreesr, speed=None, direction="shortest"):
         """Run pair to position (in degrees)
 
         :param degreesl: Position in degrees for left motor
         :param degreesr: Position in degrees for right motor
-        :param speed: Speed ranging from -100 to 100
+        :param speed: Speed ranging from -100 to 100, of which only the size is used
         :param direction: shortest (default)/clockwise/anticlockwise
+        :raises MotorError: Occurs if invalid speed or angle passed
         """
         if speed is None:
-            th1 = threading.Thread(target=self._leftmotor._run_to_position, args=(degreesl, self.default_speed, direction))
-            th2 = threading.Thread(target=self._rightmotor._run_to_position, args=(degreesr, self.default_speed, direction))
-        else:
-            th1 = threading.Thread(target=self._leftmotor._run_to_position, args=(degreesl, speed, direction))
-            th2 = threading.Thread(target=self._rightmotor._run_to_position, args=(degreesr, speed, direction))
-        th1.daemon = True
-        th2.daemon = True
-        th1.start()
-        th2.start()
-        th1.join()
-        th2.join()
+            speed = self.default_speed
+        if not (speed >= -100 and speed <= 100):
+            raise MotorError("Invalid Speed")
+        # The direction comes from the positions, so a negative speed has always moved the same way
+        self._group.run_to_position([degreesl, degreesr], abs(speed), direction)
 
     @property
     def release(self):
@@ -643,5 +1286,4 @@ class MotorPair:
         if not isinstance(value, bool):
             raise MotorError("Must pass boolean")
         self._release = value
-        self._leftmotor.release = value
-        self._rightmotor.release = value
+        self._group.release = value
@@ -0,0 +1,178 @@
+"""Color classification with precomputed lookup tables"""
+
+from collections import deque
+
+DEFAULT_COLORS = [("black", (0, 0, 0)),
+                  ("violet", (127, 0, 255)),
+                  ("blue", (0, 0, 255)),
+                  ("cyan", (0, 183, 235)),
+                  ("green", (0, 128, 0)),
+                  ("yellow", (255, 255, 0)),
+                  ("red", (255, 0, 0)),
+                  ("white", (255, 255, 255))]
+
+
+class ColorPalette:
+    """Named colors, and a lookup table from RGB to the nearest of them
+
+    Each channel is quantised to a number of bits, and the nearest color to
+    every cell is found once, so classifying a reading is usually a single
+    table lookup rather than a distance to every color. Cells that straddle
+    the boundary between two colors fall back to the distance search, so
+    the result is always the nearest color, the first listed on a tie.
+
+    :param colors: Optional list of (name, (r, g, b)) tuples, with values 0 to 255
+    :param bits: Optional bits per channel of the lookup table, 1 to 8
+    :raises ValueError: Occurs if no colors or invalid bits given
+    """
+
+    _default = None
+    # Table entry of a cell that straddles a boundary between colors
+    _SEARCH = 255
+
+    def __init__(self, colors=None, bits=5):
+        """Create palette
+
+        :param colors: Optional list of (name, (r, g, b)) tuples, with values 0 to 255
+        :param bits: Optional bits per channel of the lookup table, 1 to 8
+        :raises ValueError: Occurs if no colors or invalid bits given
+        """
+        if colors is None:
+            colors = DEFAULT_COLORS
+        colors = [(name, tuple(rgb)) for name, rgb in colors]
+        if len(colors) == 0 or len(colors) >= ColorPalette._SEARCH:
+            raise ValueError("Palette needs 1 to 255 colors")
+        if not isinstance(bits, int) or not (1 <= bits <= 8):
+            raise ValueError("bits should be 1 to 8")
+        self.colors = colors
+        self.bits = bits
+        self._shift = 8 - bits
+        self._lut = None
+
+    @classmethod
+    def default(cls):
+        """Palette of the colors the sensors have always reported
+
+        :return: Shared ColorPalette
+        """
+        if cls._default is None:
+            cls._default = cls()
+        return cls._default
+
+    @classmethod
+    def from_samples(cls, samples, bits=5):
+        """Calibrate a palette from readings of known colors
+
+        :param samples: Dictionary of color name to list of (r, g, b) readings
+        :param bits: Optional bits per channel of the lookup table
+        :return: ColorPalette of the average reading of each color
+        """
+        colors = []
+        for name, reads in samples.items():
+            reads = list(reads)
+            colors.append((name, tuple(int(sum(read[i] for read in reads) / len(reads)) for i in range(3))))
+        return cls(colors, bits)
+
+    def _build(self):
+        cells = 1 << self.bits
+        size = 1 << self._shift
+        centres = [q * size + size // 2 for q in range(cells)]
+        # Squared distance separates into a term per channel, so precompute each
+        dist = [[[(c - rgb[i]) ** 2 for c in centres] for i in range(3)] for _, rgb in self.colors]
+        ncolors = range(len(self.colors))
+        # How much further from color j than from color k a channel can be within
+        # a cell, which is linear in the channel so greatest at one of its ends
+        margin = [[[[min(((lo - rgb_j[i]) ** 2 - (lo - rgb_k[i]) ** 2),
+                          ((lo + size - 1 - rgb_j[i]) ** 2 - (lo + size - 1 - rgb_k[i]) ** 2))
+                     for lo in range(0, 256, size)] for i in range(3)]
+                   for _, rgb_j in self.colors] for _, rgb_k in self.colors]
+        lut = bytearray(cells ** 3)
+        idx = 0
+        for qr in range(cells):
+            for qg in range(cells):
+                rg = [dist[k][0][qr] + dist[k][1][qg] for k in ncolors]
+                for qb in range(cells):
+                    best = 0
+                    bestd = rg[0] + dist[0][2][qb]
+                    for k in ncolors:
+                        d = rg[k] + dist[k][2][qb]
+                        if d < bestd:
+                            best = k
+                            bestd = d
+                    # Nearest to every reading in the cell, beating earlier colors outright
+                    for j, m in enumerate(margin[best]):
+                        if j != best:
+                            least = m[0][qr] + m[1][qg] + m[2][qb]
+                            if least < 0 or (least == 0 and j < best):
+                                best = ColorPalette._SEARCH
+                                break
+                    lut[idx] = best
+                    idx += 1
+        self._lut = lut
+
+    def _search(self, r, g, b):
+        near = None
+        euc = None
+        for name, (cr, cg, cb) in self.colors:
+            cur = (r - cr) ** 2 + (g - cg) ** 2 + (b - cb) ** 2
+            if euc is None or cur < euc:
+                near = name
+                euc = cur
+        return near
+
+    def classify(self, r, g, b):
+        """Return the name of the nearest color
+
+        :param r: Red, 0 to 255
+        :param g: Green, 0 to 255
+        :param b: Blue, 0 to 255
+        :return: Name of the color as a string
+        :rtype: str
+        """
+        if self._lut is None:
+            self._build()
+        if not (type(r) is int and type(g) is int and type(b) is int and 0 <= r <= 255 and 0 <= g <= 255 and 0 <= b <= 255):
+            return self._search(r, g, b)
+        shift = self._shift
+        bits = self.bits
+        best = self._lut[((((r >> shift) << bits) | (g >> shift)) << bits) | (b >> shift)]
+        if best == ColorPalette._SEARCH:
+            return self._search(r, g, b)
+        return self.colors[best][0]
+
+
+class RunningAverage:
+    """Moving average of the last n readings, updated in constant time per reading
+
+    :param n: Number of readings averaged
+    :param width: Number of values in each reading
+    """
+
+    def __init__(self, n, width):
+        """Create moving average
+
+        :param n: Number of readings averaged
+        :param width: Number of values in each reading
+        """
+        self.n = n
+        self.width = width
+        self.reads = deque()
+        self.sums = [0] * width
+
+    def add(self, read):
+        """Add a reading
+
+        :param read: Values of reading
+        :return: Integer average of each value once n readings have been added, otherwise None
+        """
+        sums = self.sums
+        for i in range(self.width):
+            sums[i] += read[i]
+        self.reads.append(read)
+        if len(self.reads) > self.n:
+            old = self.reads.popleft()
+            for i in range(self.width):
+                sums[i] -= old[i]
+        if len(self.reads) < self.n:
+            return None
+        return [int(s / self.n) for s in sums]
@@ -0,0 +1,196 @@
+"""Sampling several devices together"""
+
+import time
+import weakref
+from collections import deque, namedtuple
+from threading import Condition
+
+from .exc import DeviceError
+
+SampleSet = namedtuple("SampleSet", ["timestamp", "spread", "times", "values"])
+SampleSet.__doc__ = """Concurrent frames from every device in a SampleGroup
+
+timestamp is the time.monotonic() the last frame of the set was received,
+spread the seconds between the first and last, times when each frame was
+received, and values its data, in the order the devices were given.
+"""
+
+
+class SampleGroup:
+    """Samples several devices at the same rate, delivering their concurrent frames together
+
+    The devices are selected in a single command line, so the firmware
+    starts sampling them in the same tick, at the same interval. Each frame
+    is stamped with the time.monotonic() it was received, as the firmware
+    doesn't report when it took a reading. Once every device has sent a
+    frame, and they were received within the tolerance of each other, they
+    are delivered as a SampleSet, to a callback or get().
+
+    For example::
+
+        with SampleGroup(force, motor, interval=20) as group:
+            for sample in group:
+                (newtons, *_), (speed, pos, apos) = sample.values
+
+    :param devices: Devices to sample, each already in the mode to sample
+    :param interval: Optional interval in milliseconds, otherwise that of the first device
+    :param tolerance: Optional seconds within which frames count as concurrent, otherwise half the interval
+    :param maxlen: Number of sets held for get() before the oldest are dropped
+    :raises DeviceError: Occurs if fewer than 2 devices are given, or one isn't in a mode
+    """
+
+    def __init__(self, *devices, interval=None, tolerance=None, maxlen=100):
+        """Initialise and start sample group
+
+        :param devices: Devices to sample, each already in the mode to sample
+        :param interval: Optional interval in milliseconds, otherwise that of the first device
+        :param tolerance: Optional seconds within which frames count as concurrent, otherwise half the interval
+        :param maxlen: Number of sets held for get() before the oldest are dropped
+        :raises DeviceError: Occurs if fewer than 2 devices are given, or one isn't in a mode
+        """
+        if len(devices) < 2:
+            raise DeviceError("A sample group needs 2 or more devices")
+        self._devices = tuple(devices)
+        self._interval = devices[0].interval if interval is None else interval
+        self._tolerance = self._interval / 2000 if tolerance is None else tolerance
+        self._cond = Condition()
+        self._sets = deque(maxlen=maxlen)
+        self._latest = [None] * len(devices)
+        self._waiting = set(range(len(devices)))
+        self._callit = None
+        self._listeners = None
+        self.dropped = 0
+        self.skipped = 0
+        self.start()
+
+    @property
+    def devices(self):
+        """Devices in group
+
+        :return: Devices, in the order they were given
+        :rtype: tuple
+        """
+        return self._devices
+
+    def start(self):
+        """Select every device at the group interval, and start collecting sets
+
+        :raises DeviceError: Occurs if a device isn't in a simple or combi mode
+        """
+        if self._listeners is not None:
+            return
+        hats = {}
+        for dev in self._devices:
+            if dev._simplemode == -1 and dev._combimode == -1:
+                raise DeviceError("Not in simple or combimode")
+            hats.setdefault(id(dev._hat), []).append(dev)
+        self._listeners = []
+        for i, dev in enumerate(self._devices):
+            def listener(now, data, i=i):
+                self._frame(i, now, data)
+            dev._conn.add_listener(listener)
+            self._listeners.append((dev._conn, listener))
+        for devs in hats.values():
+            with devs[0]._hat.batch():
+                for dev in devs:
+                    # Selecting again restarts its sampling in step with the others
+                    dev._interval = self._interval
+                    dev._forget_config()
+                    idx = dev._simplemode if dev._simplemode != -1 else dev._combimode
+                    dev._write(f"port {dev.port} ; {dev._select_cmd(idx)}\r")
+
+    def stop(self):
+        """Stop collecting sets, leaving the devices selected"""
+        if self._listeners is None:
+            return
+        for conn, listener in self._listeners:
+            conn.remove_listener(listener)
+        self._listeners = None
+        with self._cond:
+            self._waiting = set(range(len(self._devices)))
+            self._cond.notify_all()
+
+    def __enter__(self):
+        """Use group in a with block, stopping it at the end
+
+        :return: SampleGroup
+        """
+        return self
+
+    def __exit__(self, *args):
+        """Stop group at the end of a with block
+
+        :param args: Exception details
+        """
+        self.stop()
+
+    def _frame(self, i, now, data):
+        """Record a frame from one device, from the serial reader thread"""
+        with self._cond:
+            self._latest[i] = (now, data)
+            self._waiting.discard(i)
+            if len(self._waiting) > 0:
+                return
+            times = tuple(t for t, _ in self._latest)
+            newest = max(times)
+            spread = newest - min(times)
+            if spread > self._tolerance:
+                # Frames too old to be concurrent with the newest are replaced first
+                self._waiting = {j for j, t in enumerate(times) if newest - t > self._tolerance}
+                self.skipped += 1
+                return
+            sample = SampleSet(newest, spread, times, tuple(d for _, d in self._latest))
+            self._waiting = set(range(len(self._devices)))
+            if len(self._sets) == self._sets.maxlen:
+                self.dropped += 1
+            self._sets.append(sample)
+            self._cond.notify_all()
+            callit = self._callit
+        if callit is not None:
+            dev = self._devices[0]
+            dev._hat.dispatchers[dev.port].put(callit, sample)
+
+    def callback(self, func):
+        """Set function called with each SampleSet
+
+        Called on the callback thread of the first device's port.
+
+        :param func: Function called with a SampleSet, or None to stop calling it
+        """
+        if func is None:
+            self._callit = None
+            return
+        try:
+            self._callit = weakref.WeakMethod(func)
+        except TypeError:
+            # Not a bound method, so there's no object to outlive
+            self._callit = lambda: func
+
+    def get(self, timeout=None):
+        """Wait for the oldest SampleSet not yet read
+
+        :param timeout: Optional time in seconds to wait
+        :return: SampleSet
+        :raises DeviceError: Occurs if the timeout passes, or the group is stopped
+        """
+        deadline = None if timeout is None else time.monotonic() + timeout
+        with self._cond:
+            while len(self._sets) == 0:
+                if self._listeners is None:
+                    raise DeviceError("Sample group stopped")
+                remaining = None if deadline is None else deadline - time.monotonic()
+                if remaining is not None and remaining <= 0:
+                    raise DeviceError("Timed out waiting for samples")
+                self._cond.wait(remaining)
+            return self._sets.popleft()
+
+    def __iter__(self):
+        """Iterate over sets until the group is stopped
+
+        :return: Iterator of SampleSet
+        """
+        while True:
+            try:
+                yield self.get()
+            except DeviceError:
+                return
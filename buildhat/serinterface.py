@@ -3,16 +3,18 @@
 import logging
 import os
 import queue
-import tempfile
+import socket
 import threading
 import time
+from collections import deque
+from contextlib import contextmanager
 from enum import Enum
-from threading import Condition, Timer
+from threading import Condition, Event, Timer
 
 import serial
-from gpiozero import DigitalOutputDevice
 
-from .exc import BuildHATError
+from .exc import BuildHATError, DeviceError
+from .metrics import Histogram, Metrics
 
 
 class HatState(Enum):
@@ -24,6 +26,204 @@ class HatState(Enum):
     BOOTLOADER = 3
 
 
+class CallbackPolicy(Enum):
+    """What to do with a new callback event when a port's queue is full"""
+
+    DROP_OLDEST = 0
+    COALESCE = 1
+
+
+class MotorQueuePolicy(Enum):
+    """What to do with a non-blocking motor command when others are queued"""
+
+    APPEND = 0
+    REPLACE = 1
+    PREEMPT = 2
+
+
+class MotorQueue:
+    """Non-blocking motor commands for one port, run in order by motorloop
+
+    The thread running them is only started once a command is queued.
+    """
+
+    def __init__(self, worker):
+        """Initialise queue
+
+        :param worker: Function run on the queue's thread, called with the queue
+        """
+        self.worker = worker
+        self.th = None
+        self.cond = Condition()
+        self.pending = deque()
+        self.busy = False
+        self.preempts = 0
+        self.dropped = 0
+
+    def put(self, cmd, policy=MotorQueuePolicy.APPEND):
+        """Queue command
+
+        :param cmd: Tuple of function and arguments
+        :param policy: APPEND to run after everything queued, REPLACE to discard commands
+                       not yet started, or PREEMPT to also interrupt the running command
+        :return: Whether a running command needs interrupting
+        """
+        with self.cond:
+            preempt = self._discard(policy)
+            self.pending.append(cmd)
+            self.cond.notify_all()
+            if self.th is None:
+                self.th = threading.Thread(target=self.worker, args=(self,))
+                self.th.daemon = True
+                self.th.start()
+        return preempt
+
+    def stop(self):
+        """Stop the thread, once the commands already queued have run"""
+        with self.cond:
+            if self.th is not None:
+                self.pending.append((None, None))
+                self.cond.notify_all()
+
+    def discard(self, policy):
+        """Make way for a new command, without queueing one
+
+        :param policy: APPEND to keep everything, REPLACE to discard commands not yet
+                       started, or PREEMPT to also interrupt the running command
+        :return: Whether a running command needs interrupting
+        """
+        with self.cond:
+            preempt = self._discard(policy)
+            self.cond.notify_all()
+        return preempt
+
+    def _discard(self, policy):
+        if policy != MotorQueuePolicy.APPEND:
+            self.dropped += len(self.pending)
+            self.pending.clear()
+        preempt = policy == MotorQueuePolicy.PREEMPT and self.busy
+        if preempt:
+            self.preempts += 1
+        return preempt
+
+    def get(self):
+        """Wait for the next command, which is then running until task_done()
+
+        :return: Tuple of function and arguments
+        """
+        with self.cond:
+            while len(self.pending) == 0:
+                self.cond.wait()
+            self.busy = True
+            return self.pending.popleft()
+
+    def task_done(self):
+        """Mark the running command finished"""
+        with self.cond:
+            self.busy = False
+            self.cond.notify_all()
+
+    def join(self):
+        """Wait until every queued command has finished"""
+        with self.cond:
+            while self.busy or len(self.pending) > 0:
+                self.cond.wait()
+
+    def pause(self, seconds):
+        """Sleep, unless the running command is preempted first
+
+        :param seconds: Time to sleep
+        :return: Whether the whole time passed without being preempted
+        """
+        with self.cond:
+            preempts = self.preempts
+            return not self.cond.wait_for(lambda: self.preempts != preempts, seconds)
+
+
+class CallbackDispatcher:
+    """Runs callbacks for one port on its own thread, from a bounded queue
+
+    The thread is only started once there is a callback to run.
+    """
+
+    DEFAULT_MAXLEN = 100
+
+    def __init__(self, maxlen=DEFAULT_MAXLEN, policy=CallbackPolicy.DROP_OLDEST):
+        """Initialise dispatcher
+
+        :param maxlen: Number of events that can wait to be delivered
+        :param policy: Whether to drop the oldest event when the queue is full, or only ever keep the latest
+        """
+        self.maxlen = maxlen
+        self.policy = policy
+        self.dropped = 0
+        self.maxdepth = 0
+        self.waited = Histogram()
+        self.ran = Histogram()
+        self.running = True
+        self.events = deque()
+        self.cond = Condition()
+        self.th = None
+
+    def configure(self, maxlen, policy):
+        """Change queue length and overflow policy
+
+        :param maxlen: Number of events that can wait to be delivered
+        :param policy: Whether to drop the oldest event when the queue is full, or only ever keep the latest
+        """
+        with self.cond:
+            self.maxlen = maxlen
+            self.policy = policy
+
+    def put(self, callit, data):
+        """Queue callback event
+
+        :param callit: Weak reference to callback function
+        :param data: Data to pass to the callback
+        """
+        with self.cond:
+            if self.policy == CallbackPolicy.COALESCE:
+                self.dropped += len(self.events)
+                self.events.clear()
+            elif len(self.events) >= self.maxlen:
+                self.events.popleft()
+                self.dropped += 1
+            self.events.append((callit, data, time.monotonic()))
+            if len(self.events) > self.maxdepth:
+                self.maxdepth = len(self.events)
+            self.cond.notify()
+            if self.th is None and self.running:
+                self.th = threading.Thread(target=self.run)
+                self.th.daemon = True
+                self.th.start()
+
+    def run(self):
+        """Deliver callback events until stopped"""
+        while True:
+            with self.cond:
+                while self.running and len(self.events) == 0:
+                    self.cond.wait()
+                if not self.running:
+                    break
+                callit, data, queued = self.events.popleft()
+            func = callit()
+            if func is not None:
+                start = time.monotonic()
+                self.waited.observe(start - queued)
+                func(data)
+                self.ran.observe(time.monotonic() - start)
+                # Otherwise the device stays alive until the next event
+                func = None
+
+    def stop(self):
+        """Stop delivering events"""
+        with self.cond:
+            self.running = False
+            self.cond.notify()
+        if self.th is not None:
+            self.th.join()
+
+
 class Connection:
     """Connection information for a port"""
 
@@ -34,6 +234,56 @@ class Connection:
         self.callit = None
         self.simplemode = -1
         self.combimode = -1
+        self.formats = {}
+        self.sample = None
+        self.ring = None
+        self.listeners = ()
+        self.filters = ()
+        # Called with frames from whatever mode is selected, set by BuildHAT.observe()
+        self.observer = None
+        self.generation = 0
+
+    def add_listener(self, func):
+        """Call a function from the serial reader thread for each data frame
+
+        :param func: Function called with time.monotonic() of the frame and its data
+        """
+        self.listeners = self.listeners + (func,)
+
+    def remove_listener(self, func):
+        """Stop calling a function added with add_listener()
+
+        :param func: Function to remove
+        """
+        self.listeners = tuple(f for f in self.listeners if f is not func)
+
+    def decode(self, key, values):
+        """Convert the values of a data frame to numbers
+
+        The firmware prints every value of a mode in the same format, so the
+        converters found for the first frame of a mode are reused for the
+        following frames, rather than inspecting each value every time.
+
+        :param key: Frame type and mode, such as "C0" or "M5"
+        :param values: Text of the values in the frame
+        :return: List of values
+        """
+        tokens = values.split()
+        fmt = self.formats.get(key)
+        try:
+            if fmt is int:
+                return list(map(int, tokens))
+            elif fmt is not None and len(fmt) == len(tokens):
+                return [conv(t) for conv, t in zip(fmt, tokens)]
+        except ValueError:
+            pass
+        fmt = [float if "." in t else int for t in tokens]
+        if float not in fmt:
+            fmt = int
+        self.formats[key] = fmt
+        if fmt is int:
+            return list(map(int, tokens))
+        return [conv(t) for conv, t in zip(fmt, tokens)]
 
     def update(self, typeid, connected, callit=None):
         """Update connection information for port
@@ -45,6 +295,263 @@ class Connection:
         self.typeid = typeid
         self.connected = connected
         self.callit = callit
+        # Anything configured on the port before has been lost
+        self.generation += 1
+        self.formats = {}
+        self.sample = None
+        if self.ring is not None:
+            self.ring.reset()
+
+
+# Threads within BuildHAT.batch(), whose commands are held until the block ends
+_batching = threading.local()
+
+
+def check_not_batching():
+    """Check this thread can wait for the firmware
+
+    :raises BuildHATError: Occurs if within BuildHAT.batch(), as the commands
+                           being waited on are only sent when the block ends
+    """
+    if getattr(_batching, "depth", 0) > 0:
+        raise BuildHATError("Can't wait for the Build HAT within batch(), as commands are only sent once it ends")
+
+
+class Completion:
+    """Wakes everyone waiting for the next occurrence of an event
+
+    The serial reader thread calls set() each time the event happens, such
+    as a data frame arriving or a ramp finishing. A caller takes a token()
+    before asking the firmware to do something, then waits for the first
+    occurrence after it. An occurrence can't be missed or handed to the
+    wrong caller, and any number of waiters share one notification.
+    """
+
+    def __init__(self):
+        """Initialise completion"""
+        self._cond = Condition()
+        self._count = 0
+        self._value = None
+        self._error = None
+        self._waiters = 0
+        self._callbacks = []
+        # Optional Histogram of how long callers of wait() blocked for
+        self.histogram = None
+
+    def token(self):
+        """Mark the point after which an occurrence is wanted
+
+        :return: Token to pass to wait(), wait_async() or add_callback()
+        """
+        return self._count
+
+    def wait(self, token=None, timeout=None):
+        """Wait for an occurrence after a token
+
+        :param token: Optional token, otherwise waits for the next occurrence
+        :param timeout: Optional time to wait in seconds
+        :return: Value the occurrence was set with
+        :raises BuildHATError: Occurs if the timeout passes first, or if called within BuildHAT.batch()
+        """
+        with self._cond:
+            if token is None:
+                token = self._count
+            if self._count == token:
+                check_not_batching()
+                self._waiters += 1
+                start = time.monotonic()
+                try:
+                    if not self._cond.wait_for(lambda: self._count != token, timeout):
+                        raise BuildHATError("Timed out waiting for Build HAT")
+                finally:
+                    self._waiters -= 1
+                    if self.histogram is not None:
+                        self.histogram.observe(time.monotonic() - start)
+            if self._error is not None:
+                raise self._error
+            return self._value
+
+    def add_callback(self, func, token=None):
+        """Call a function once, for an occurrence after a token
+
+        Called from the serial reader thread, or straight away if there has
+        already been an occurrence since the token.
+
+        :param func: Function called with the value and error, one of which is None
+        :param token: Optional token, otherwise called for the next occurrence
+        """
+        with self._cond:
+            if token is None or self._count == token:
+                self._callbacks.append(func)
+                return
+            value, error = self._value, self._error
+        func(value, error)
+
+    async def wait_async(self, token=None):
+        """Await an occurrence after a token
+
+        The value is passed to the event loop with call_soon_threadsafe, so
+        no thread is blocked waiting.
+
+        :param token: Optional token, otherwise waits for the next occurrence
+        :return: Value the occurrence was set with
+        :raises BuildHATError: Occurs if called within BuildHAT.batch()
+        """
+        if token is None or self._count == token:
+            check_not_batching()
+        import asyncio
+
+        loop = asyncio.get_running_loop()
+        afut = loop.create_future()
+
+        def settle(value, error):
+            if afut.done():
+                return
+            if error is not None:
+                afut.set_exception(error)
+            else:
+                afut.set_result(value)
+
+        def done(value, error):
+            try:
+                loop.call_soon_threadsafe(settle, value, error)
+            except RuntimeError:
+                # Event loop has been closed
+                pass
+
+        self.add_callback(done, self._count if token is None else token)
+        return await afut
+
+    def _complete(self, value, error):
+        with self._cond:
+            self._count += 1
+            self._value = value
+            self._error = error
+            callbacks = self._callbacks
+            if len(callbacks) > 0:
+                self._callbacks = []
+            if self._waiters > 0:
+                self._cond.notify_all()
+        for func in callbacks:
+            func(value, error)
+
+    def set(self, value=True):
+        """Record an occurrence, waking everyone waiting for it
+
+        :param value: Value to pass to waiters
+        """
+        self._complete(value, None)
+
+    def fail(self, error):
+        """Record that the event won't happen, raising an error in everyone waiting for it
+
+        :param error: Exception to raise
+        """
+        self._complete(None, error)
+
+
+class Query:
+    """A command sent to the firmware, waiting for its reply"""
+
+    def __init__(self):
+        """Initialise query"""
+        self.sent = time.monotonic()
+        self.done = Completion()
+        self.token = self.done.token()
+
+
+class SocketSerial:
+    """Serial-like connection to buildhatd over a Unix socket"""
+
+    RECV_SIZE = 4096
+
+    def __init__(self, path, timeout=1):
+        """Connect to buildhatd
+
+        :param path: Path of buildhatd socket
+        :param timeout: Read timeout in seconds
+        """
+        self.path = path
+        self.timeout = timeout
+        self.baudrate = BuildHAT.BAUDRATE
+        self.rxbuf = bytearray()
+        self.sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        self.sock.connect(path)
+
+    @property
+    def in_waiting(self):
+        """Number of bytes already received
+
+        :return: Bytes waiting to be read
+        """
+        return len(self.rxbuf)
+
+    def read(self, size=1):
+        """Read whatever has arrived, waiting up to the timeout for something
+
+        :param size: Minimum number of bytes wanted
+        :return: Bytes read, which may be more than size
+        """
+        if len(self.rxbuf) == 0:
+            self._recv(size)
+        data = bytes(self.rxbuf)
+        self.rxbuf.clear()
+        return data
+
+    def _recv(self, size=1):
+        """Add whatever arrives within the timeout to rxbuf
+
+        :param size: Minimum number of bytes wanted
+        :return: Whether anything arrived
+        """
+        self.sock.settimeout(self.timeout)
+        try:
+            data = self.sock.recv(max(size, SocketSerial.RECV_SIZE))
+        except socket.timeout:
+            return False
+        except OSError as e:
+            raise serial.SerialException(str(e))
+        if len(data) == 0:
+            # buildhatd went away, so don't spin
+            time.sleep(self.timeout)
+            return False
+        self.rxbuf += data
+        return True
+
+    def readline(self):
+        """Read a single line
+
+        :return: Line, or whatever arrived before the timeout
+        """
+        while b"\n" not in self.rxbuf:
+            if not self._recv():
+                break
+        end = self.rxbuf.find(b"\n") + 1 or len(self.rxbuf)
+        line = bytes(self.rxbuf[:end])
+        del self.rxbuf[:end]
+        return line
+
+    def write(self, data):
+        """Send data to buildhatd
+
+        :param data: Data to send
+        """
+        try:
+            self.sock.sendall(data)
+        except OSError as e:
+            raise serial.SerialException(str(e))
+
+    def flush(self):
+        """Nothing to flush, as writes are sent immediately"""
+        pass
+
+    def reset_input_buffer(self):
+        """Discard anything received but not yet read"""
+        self.rxbuf.clear()
+
+    def close(self):
+        """Close connection to buildhatd"""
+        self.sock.close()
 
 
 def cmp(str1, str2):
@@ -71,52 +578,216 @@ class BuildHAT:
     BOOTLOADER = "BuildHAT bootloader version"
     DONE = "Done initialising ports"
     PROMPT = "BHBL>"
+    CLAIM = "@claim"
+    RELEASE = "@release"
+    OBSERVE = "@observe"
+    UNOBSERVE = "@unobserve"
+    CLAIMED = "@claimed"
+    BUSY = "@busy"
+    CLAIM_TIMEOUT = 5
+    QUERIES = ("vin", "version", "list")
+    DAEMON_SOCKET = "/tmp/buildhatd.sock"
+    BAUDRATE = 115200
+    WRITE_WINDOW = 0.001
+    # The firmware doesn't document its input buffer size. Merged lines are
+    # kept within the ramp and pulse commands the library has always sent,
+    # which run to about 130 bytes. A longer single command is sent whole.
+    MAX_LINE = 128
+    CHUNK_SIZE = 1024
+    CRCTABLE = None
+    PROBE_TIMEOUT = 0.5
+    PROBE_RETRIES = 6
+    LIST_INTERVAL = 0.25
+    SETTLE_TIME = 1.0
+    STARTUP_TIMEOUT = 8.0
     RESET_GPIO_NUMBER = 4
     BOOT0_GPIO_NUMBER = 22
 
-    def __init__(self, firmware, signature, version, device="/dev/serial0", debug=False):
+    def __init__(self, firmware, signature, version, device="/dev/serial0", debug=False, trace=None):
         """Interact with Build HAT
 
         :param firmware: Firmware file
         :param signature: Signature file
         :param version: Firmware version
-        :param device: Serial device to use
+        :param device: Serial device to use, or an already open serial-like connection, such as
+                       SimulatedSerial or a SocketSerial to buildhatd
         :param debug: Optional boolean to log debug information
+        :param trace: Optional path of a binary trace file, or a TraceWriter, to record all bytes sent and received
         :raises BuildHATError: Occurs if can't find HAT
         """
-        self.cond = Condition()
+        self.started = time.monotonic()
+        self.timings = {}
+        self.readyevt = Event()
+        self.listing = False
+        self.listcount = 0
+        self.settling = False
         self.state = HatState.OTHER
+        self.shared = isinstance(device, SocketSerial)
         self.connections = []
-        self.portftr = []
-        self.pulseftr = []
-        self.rampftr = []
-        self.vinftr = []
+        self.datadone = []
+        self.claimdone = []
+        self.pulsedone = []
+        self.rampdone = []
+        self.queries = {kind: deque() for kind in BuildHAT.QUERIES}
+        self.querylock = threading.Lock()
+        # Ports reported so far in reply to the oldest list query
+        self.listreply = []
         self.motorqueue = []
+        # Ports with a device object in this process
+        self.used = [False] * 4
+        self.metrics = Metrics()
         self.fin = False
         self.running = True
         self.debug_filename = None
+        self.tracer = None
+        self.rxbuf = bytearray()
+        self.writeq = None
+        self.batchlocal = threading.local()
+        self.frames = {":": self._portmsg, "C": self._data, "M": self._data}
+        self.portmsgs = {BuildHAT.CONNECTED: self._connected,
+                         BuildHAT.CONNECTEDPASSIVE: self._connectedpassive,
+                         BuildHAT.DISCONNECTED: self._disconnected,
+                         BuildHAT.DEVTIMEOUT: self._disconnected,
+                         BuildHAT.NOTCONNECTED: self._notconnected,
+                         BuildHAT.RAMPDONE: self._rampdone,
+                         BuildHAT.PULSEDONE: self._pulsedone}
+        self.linemsgs = {BuildHAT.DONE: self._done}
+        self.taps = ()
         if debug:
-            tmp = tempfile.NamedTemporaryFile(suffix=".log", prefix="buildhat-", delete=False)
-            self.debug_filename = tmp.name
-            logging.basicConfig(filename=tmp.name, format='%(asctime)s %(message)s',
-                                level=logging.DEBUG)
+            self._start_debug()
+        if trace is not None:
+            self._start_trace(trace)
 
         for _ in range(4):
             self.connections.append(Connection())
-            self.portftr.append([])
-            self.pulseftr.append([])
-            self.rampftr.append([])
-            self.motorqueue.append(queue.Queue())
+            self.datadone.append(Completion())
+            self.pulsedone.append(Completion())
+            self.rampdone.append(Completion())
+            self.claimdone.append(Completion())
+            self.motorqueue.append(MotorQueue(self.motorloop))
+        for done in self.datadone + self.pulsedone + self.rampdone:
+            done.histogram = Histogram()
+        self.querywait = {kind: Histogram() for kind in BuildHAT.QUERIES}
+
+        if self.shared:
+            self._attach(device)
+            return
 
         # On a Pi 5 /dev/serial0 will point to /dev/ttyAMA10 (which *only*
         # exists on a Pi 5, and is the 3-pin debug UART connector)
         # The UART on the Pi 5 GPIO header is /dev/ttyAMA0
         if device == "/dev/serial0" and os.readlink(device) == "ttyAMA10":
             device = "/dev/ttyAMA0"
-        self.ser = serial.Serial(device, 115200, timeout=5)
+        if isinstance(device, str):
+            self.ser = serial.Serial(device, BuildHAT.BAUDRATE, timeout=5)
+        else:
+            self.ser = device
+            self.ser.baudrate = BuildHAT.BAUDRATE
+            self.ser.timeout = 5
+        self.mark("open")
         # Check if we're in the bootloader or the firmware
-        self.write(b"version\r")
+        self.state = self.probe(version)
+        self.mark("probe")
+
+        if self.state == HatState.NEEDNEWFIRMWARE:
+            self.resethat()
+            self.loadfirmware(firmware, signature)
+            self.mark("firmware")
+        elif self.state == HatState.BOOTLOADER:
+            self.loadfirmware(firmware, signature)
+            self.mark("firmware")
+        elif self.state == HatState.OTHER:
+            raise BuildHATError("HAT not found")
+
+        self._start()
+
+    def _start_debug(self):
+        import tempfile
+
+        tmp = tempfile.NamedTemporaryFile(suffix=".log", prefix="buildhat-", delete=False)
+        self.debug_filename = tmp.name
+        logging.basicConfig(filename=tmp.name, format='%(asctime)s %(message)s',
+                            level=logging.DEBUG)
+
+    def _start_trace(self, trace):
+        from .trace import TraceWriter
+
+        self.tracer = trace if isinstance(trace, TraceWriter) else TraceWriter(trace)
+
+    def reuse(self, debug=False, trace=None):
+        """Apply the options of another Hat opened for the same device
+
+        :param debug: Optional boolean to start logging debug information, if not already
+        :param trace: Optional path of a binary trace file, or a TraceWriter, to start recording into
+        :raises BuildHATError: Occurs if a different trace is already being recorded
+        """
+        if debug and self.debug_filename is None:
+            self._start_debug()
+        if trace is None:
+            return
+        if self.tracer is None:
+            self._start_trace(trace)
+        elif trace is not self.tracer and trace != self.tracer.path:
+            raise BuildHATError(f"Build HAT is already being traced into {self.tracer.path}")
 
+    def _attach(self, ser):
+        """Use a connection to buildhatd, which already has the firmware running
+
+        :param ser: Serial-like connection
+        """
+        self.ser = ser
+        self.mark("open")
+        self.state = HatState.FIRMWARE
+        for p in range(4):
+            self.linemsgs[f"{BuildHAT.CLAIMED} {p}"] = self._claimed
+            self.linemsgs[f"{BuildHAT.BUSY} {p}"] = self._claimed
+        self._start()
+
+    def _start(self):
+        """Start the threads, then wait until the ports have been listed"""
+        # Callback and motor threads are started when first needed
+        self.dispatchers = [CallbackDispatcher() for _ in range(4)]
+
+        self.writeq = queue.Queue()
+        self.wt = threading.Thread(target=self.writeloop, args=(self.writeq,))
+        self.wt.daemon = True
+        self.wt.start()
+
+        # Drop timeout value to 1s
+        self.ser.timeout = 1
+        self.th = threading.Thread(target=self.loop)
+        self.th.daemon = True
+        self.th.start()
+
+        if self.state == HatState.FIRMWARE:
+            self.write(b"port 0 ; select ; port 1 ; select ; port 2 ; select ; port 3 ; select ; echo 0\r")
+            self.startlist()
+        elif self.state == HatState.NEEDNEWFIRMWARE or self.state == HatState.BOOTLOADER:
+            self.write(b"reboot\r")
+
+        # wait for initialisation to finish
+        self.readyevt.wait()
+        logging.debug("startup timings: " + ", ".join(f"{k} {v:.3f}s" for k, v in self.timings.items()))
+
+    def mark(self, phase):
+        """Record how long startup took to reach a phase
+
+        :param phase: Name of phase
+        """
+        self.timings[phase] = time.monotonic() - self.started
+
+    def probe(self, version):
+        """Ask the HAT for its version, to find whether it is in the bootloader or the firmware
+
+        Uses short read timeouts, asking again each time nothing arrives
+
+        :param version: Firmware version
+        :return: State that the HAT is in
+        """
+        state = HatState.OTHER
+        oldtimeout = self.ser.timeout
+        self.ser.timeout = BuildHAT.PROBE_TIMEOUT
+        self.write(b"version\r")
         emptydata = 0
         incdata = 0
         while True:
@@ -124,21 +795,20 @@ class BuildHAT:
             if len(line) == 0:
                 # Didn't receive any data
                 emptydata += 1
-                if emptydata > 3:
+                if emptydata >= BuildHAT.PROBE_RETRIES:
                     break
                 else:
+                    self.write(b"version\r")
                     continue
             if cmp(line, BuildHAT.FIRMWARE):
-                self.state = HatState.FIRMWARE
                 ver = line[len(BuildHAT.FIRMWARE):].split(' ')
                 if int(ver[0]) == version:
-                    self.state = HatState.FIRMWARE
-                    break
+                    state = HatState.FIRMWARE
                 else:
-                    self.state = HatState.NEEDNEWFIRMWARE
-                    break
+                    state = HatState.NEEDNEWFIRMWARE
+                break
             elif cmp(line, BuildHAT.BOOTLOADER):
-                self.state = HatState.BOOTLOADER
+                state = HatState.BOOTLOADER
                 break
             else:
                 # got other data we didn't understand - send version again
@@ -147,45 +817,14 @@ class BuildHAT:
                     break
                 else:
                     self.write(b"version\r")
-
-        if self.state == HatState.NEEDNEWFIRMWARE:
-            self.resethat()
-            self.loadfirmware(firmware, signature)
-        elif self.state == HatState.BOOTLOADER:
-            self.loadfirmware(firmware, signature)
-        elif self.state == HatState.OTHER:
-            raise BuildHATError("HAT not found")
-
-        self.cbqueue = queue.Queue()
-        self.cb = threading.Thread(target=self.callbackloop, args=(self.cbqueue,))
-        self.cb.daemon = True
-        self.cb.start()
-
-        for q in self.motorqueue:
-            ml = threading.Thread(target=self.motorloop, args=(q,))
-            ml.daemon = True
-            ml.start()
-
-        # Drop timeout value to 1s
-        listevt = threading.Event()
-        self.ser.timeout = 1
-        self.th = threading.Thread(target=self.loop, args=(self.cond, self.state == HatState.FIRMWARE, self.cbqueue, listevt))
-        self.th.daemon = True
-        self.th.start()
-
-        if self.state == HatState.FIRMWARE:
-            self.write(b"port 0 ; select ; port 1 ; select ; port 2 ; select ; port 3 ; select ; echo 0\r")
-            self.write(b"list\r")
-            listevt.set()
-        elif self.state == HatState.NEEDNEWFIRMWARE or self.state == HatState.BOOTLOADER:
-            self.write(b"reboot\r")
-
-        # wait for initialisation to finish
-        with self.cond:
-            self.cond.wait()
+        self.ser.timeout = oldtimeout
+        return state
 
     def resethat(self):
         """Reset the HAT"""
+        # Only needed to update the firmware, so not imported until then
+        from gpiozero import DigitalOutputDevice
+
         reset = DigitalOutputDevice(BuildHAT.RESET_GPIO_NUMBER)
         boot0 = DigitalOutputDevice(BuildHAT.BOOT0_GPIO_NUMBER)
         boot0.off()
@@ -210,18 +849,55 @@ class BuildHAT:
         self.write(b"clear\r")
         self.getprompt()
         self.write(f"load {len(firm)} {self.checksum(firm)}\r".encode())
-        time.sleep(0.1)
+        self.waitfor("load", 0.1)
         self.write(b"\x02", replace="0x02")
-        self.write(firm, replace="--firmware file--")
+        self.writechunked(firm, "--firmware file--")
         self.write(b"\x03\r", replace="0x03")
         self.getprompt()
         self.write(f"signature {len(sig)}\r".encode())
-        time.sleep(0.1)
+        self.waitfor("signature", 0.1)
         self.write(b"\x02", replace="0x02")
-        self.write(sig, replace="--signature file--")
+        self.writechunked(sig, "--signature file--")
         self.write(b"\x03\r", replace="0x03")
         self.getprompt()
 
+    def writechunked(self, data, replace):
+        """Write a large block of data, in chunks
+
+        Each chunk is drained to the UART before the next is written, so
+        the transfer never runs ahead of the OS serial buffer.
+
+        :param data: Data to write to Build HAT
+        :param replace: String to log instead of the data
+        """
+        view = memoryview(data)
+        for i in range(0, len(data), BuildHAT.CHUNK_SIZE):
+            self.ser.write(view[i:i + BuildHAT.CHUNK_SIZE])
+            self.ser.flush()
+        if not self.fin:
+            logging.debug(f"> {replace}")
+
+    def waitfor(self, text, timeout):
+        """Wait until the HAT responds with a line containing text
+
+        :param text: Text to look for
+        :param timeout: Maximum time to wait in seconds
+        :return: Whether the text was found
+        """
+        self.ser.flush()
+        deadline = time.monotonic() + timeout
+        oldtimeout = self.ser.timeout
+        try:
+            while True:
+                remaining = deadline - time.monotonic()
+                if remaining <= 0:
+                    return False
+                self.ser.timeout = remaining
+                if text in self.read():
+                    return True
+        finally:
+            self.ser.timeout = oldtimeout
+
     def getprompt(self):
         """Loop until prompt is found
 
@@ -232,35 +908,183 @@ class BuildHAT:
             if cmp(line, BuildHAT.PROMPT):
                 break
 
+    @staticmethod
+    def _crctable():
+        """Table of the bootloader checksum polynomial applied to each byte value
+
+        :return: List of 256 remainders
+        """
+        if BuildHAT.CRCTABLE is None:
+            table = []
+            for i in range(256):
+                u = i << 24
+                for _ in range(8):
+                    if (u & 0x80000000) != 0:
+                        u = (u << 1) ^ 0x1d872b41
+                    else:
+                        u = u << 1
+                    u &= 0xFFFFFFFF
+                table.append(u)
+            BuildHAT.CRCTABLE = table
+        return BuildHAT.CRCTABLE
+
     def checksum(self, data):
         """Calculate checksum from data
 
+        The bootloader shifts its checksum by a single bit per byte before
+        adding the byte in, so the result is the remainder, modulo the
+        polynomial, of the sum of every byte shifted by its distance from
+        the end of the data (plus the initial value of 1 shifted by the
+        length). That sum is built with big integer operations, taking the
+        bytes eight at a time as interleaved slices, then reduced a byte at
+        a time with a lookup table, leaving an eighth of the work in Python.
+
         :param data: Data to calculate the checksum from
         :return: Checksum that has been calculated
         """
-        u = 1
-        for i in range(0, len(data)):
-            if (u & 0x80000000) != 0:
-                u = (u << 1) ^ 0x1d872b41
-            else:
-                u = u << 1
-            u = (u ^ data[i]) & 0xFFFFFFFF
-        return u
+        n = len(data)
+        total = 1 << n
+        for r in range(8):
+            part = data[r::8]
+            if len(part) > 0:
+                total ^= int.from_bytes(part, 'big') << (n - 1 - r - 8 * (len(part) - 1))
+        poly = total.to_bytes((total.bit_length() + 7) // 8, 'big')
+        if len(poly) <= 4:
+            return total
+        table = self._crctable()
+        u = 0
+        for b in poly[:-4]:
+            u = ((u << 8) & 0xFFFFFFFF) ^ table[(u >> 24) ^ b]
+        return u ^ int.from_bytes(poly[-4:], 'big')
 
     def write(self, data, log=True, replace=""):
         """Write data to the serial port of Build HAT
 
+        Once the firmware is running, commands are handed to the writer
+        thread, which merges those arriving close together into one line.
+
         :param data: Data to write to Build HAT
         :param log: Whether to log line or not
         :param replace: Whether to log an alternative string
         """
+        if self.writeq is not None and replace == "" and data.endswith(b"\r"):
+            self.metrics.command(data)
+            cmds = getattr(self.batchlocal, "cmds", None)
+            if cmds is not None:
+                cmds.append(data)
+            else:
+                self.writeq.put(data)
+            return
+        self._serwrite(data, log, replace)
+
+    def _serwrite(self, data, log=True, replace=""):
         self.ser.write(data)
+        if self.tracer is not None:
+            self.tracer.sent(data)
+        self.metrics.lines_out += 1
+        self.metrics.bytes_out += len(data)
         if not self.fin and log:
             if replace != "":
                 logging.debug(f"> {replace}")
             else:
                 logging.debug(f"> {data.decode('utf-8', 'ignore').strip()}")
 
+    @staticmethod
+    def _join(cmds):
+        """Join commands into a single line for the firmware
+
+        :param cmds: List of commands, each ending with a carriage return
+        :return: Commands separated by semicolons
+        """
+        return b" ; ".join(cmd.rstrip(b"\r ;") for cmd in cmds) + b"\r"
+
+    @staticmethod
+    def _pack(items):
+        """Join commands into lines of up to MAX_LINE bytes
+
+        A batch starts a new line rather than being split, unless it is too
+        long for one line, when it is split between its commands.
+
+        :param items: Commands, or lists of commands written within batch()
+        :return: List of lines
+        """
+        lines = []
+        line = []
+        size = 0
+        for item in items:
+            group = item if isinstance(item, list) else (item,)
+            if len(line) > 0 and size + sum(len(cmd) + 3 for cmd in group) > BuildHAT.MAX_LINE:
+                lines.append(BuildHAT._join(line))
+                line = []
+                size = 0
+            for cmd in group:
+                if len(line) > 0 and size + len(cmd) + 3 > BuildHAT.MAX_LINE:
+                    lines.append(BuildHAT._join(line))
+                    line = []
+                    size = 0
+                line.append(cmd)
+                size += len(cmd) + 3
+        if len(line) > 0:
+            lines.append(BuildHAT._join(line))
+        return lines
+
+    @contextmanager
+    def batch(self):
+        """Send all commands written by this thread within the block as one line
+
+        For example, motors on several ports can then be started by the
+        firmware in the same tick. Commands too long for one line are split
+        between commands, into as few lines as fit. Nothing is sent until
+        the block ends, so waiting for the firmware within it, such as for
+        data, vin or a blocking motor move, raises BuildHATError instead of
+        hanging.
+        """
+        if getattr(self.batchlocal, "cmds", None) is not None:
+            # Already batching, so the outer block sends everything
+            yield
+            return
+        self.batchlocal.cmds = []
+        _batching.depth = getattr(_batching, "depth", 0) + 1
+        try:
+            yield
+        finally:
+            _batching.depth -= 1
+            cmds = self.batchlocal.cmds
+            self.batchlocal.cmds = None
+            if len(cmds) > 0 and self.writeq is not None:
+                # Each command was already counted as it was added
+                self.writeq.put(cmds)
+            elif len(cmds) > 0:
+                for line in self._pack([cmds]):
+                    self._serwrite(line)
+
+    def writeloop(self, q):
+        """Write commands to the Build HAT, merging those that arrive together
+
+        Commands queued within WRITE_WINDOW of the first one are joined
+        into lines of up to MAX_LINE bytes.
+
+        :param q: Queue of commands, and lists of commands from batch()
+        """
+        stop = False
+        while not stop:
+            cmd = q.get()
+            if cmd is None:
+                break
+            cmds = [cmd]
+            deadline = time.monotonic() + BuildHAT.WRITE_WINDOW
+            while True:
+                try:
+                    cmd = q.get(timeout=max(0, deadline - time.monotonic()))
+                except queue.Empty:
+                    break
+                if cmd is None:
+                    stop = True
+                    break
+                cmds.append(cmd)
+            for line in self._pack(cmds):
+                self._serwrite(line)
+
     def read(self):
         """Read data from the serial port of Build HAT
 
@@ -268,23 +1092,60 @@ class BuildHAT:
         """
         line = ""
         try:
-            line = self.ser.readline().decode('utf-8', 'ignore').strip()
+            data = self.ser.readline()
+            if self.tracer is not None:
+                self.tracer.received(data)
+            line = data.decode('utf-8', 'ignore').strip()
         except serial.SerialException:
             pass
         if line != "":
             logging.debug(f"< {line}")
         return line
 
+    def readlines(self):
+        """Read all complete lines available from the serial port of Build HAT
+
+        Waits up to the serial timeout for data to arrive, then takes
+        everything already buffered in a single read, so that a burst of
+        lines costs one call rather than one per line.
+
+        :return: List of lines that have been read
+        """
+        try:
+            data = self.ser.read(max(1, self.ser.in_waiting))
+        except serial.SerialException:
+            return []
+        self.rxbuf += data
+        self.metrics.bytes_in += len(data)
+        if self.tracer is not None:
+            self.tracer.received(data)
+        end = self.rxbuf.rfind(b"\n")
+        if end == -1:
+            return []
+        lines = self.rxbuf[:end].decode('utf-8', 'ignore').split("\n")
+        del self.rxbuf[:end + 1]
+        self.metrics.lines_in += len(lines)
+        lines = [line.strip() for line in lines]
+        if logging.getLogger().isEnabledFor(logging.DEBUG):
+            for line in lines:
+                if line != "":
+                    logging.debug(f"< {line}")
+        return lines
+
     def shutdown(self):
         """Turn off the Build HAT devices"""
         if not self.fin:
             self.fin = True
             self.running = False
             self.th.join()
-            self.cbqueue.put(())
             for q in self.motorqueue:
-                q.put((None, None))
-            self.cb.join()
+                q.stop()
+            for dispatcher in self.dispatchers:
+                dispatcher.stop()
+            # Flush anything still queued, then write directly
+            self.writeq.put(None)
+            self.wt.join()
+            self.writeq = None
             turnoff = ""
             for p in range(4):
                 conn = self.connections[p]
@@ -295,6 +1156,8 @@ class BuildHAT:
                     self.write(f"port {p} ; write1 {hexstr}\r".encode())
             self.write(f"{turnoff}\r".encode())
             self.write(b"port 0 ; select ; port 1 ; select ; port 2 ; select ; port 3 ; select ; echo 0\r")
+            if self.tracer is not None:
+                self.tracer.close()
 
     def motorloop(self, q):
         """Event handling for non-blocking motor commands
@@ -306,107 +1169,393 @@ class BuildHAT:
             if func is None:
                 break
             else:
-                func(*data)
+                try:
+                    func(*data)
+                except Exception as e:
+                    # Preempted, or the motor was disconnected, so carry on with the next
+                    logging.debug(f"motor command on port {self.motorqueue.index(q)} ended: {e}")
                 func = None  # Necessary for 'del' to function correctly on motor object
                 data = None
                 q.task_done()
 
-    def callbackloop(self, q):
-        """Event handling for callbacks
+    def stats(self):
+        """Counters and histograms recorded while talking to the Build HAT
 
-        :param q: Queue of callback events
+        Histograms are dictionaries of count, sum, max, p50, p99 and cumulative
+        buckets, in seconds. Parse time is per line, averaged over each read.
+
+        :return: Dictionary of stats, with a dictionary of stats for each port
         """
-        while self.running:
-            cb = q.get()
-            # Test for empty tuple, which should only be passed when
-            # we're shutting down
-            if len(cb) == 0:
-                continue
-            if not cb[0]._alive:
-                continue
-            cb[0]()(cb[1])
-            q.task_done()
+        m = self.metrics
+        ports = []
+        for p in range(4):
+            port = m.ports[p]
+            dispatcher = self.dispatchers[p]
+            motorq = self.motorqueue[p]
+            ports.append({"port": p,
+                          "lines_in": port.lines_in,
+                          "bytes_in": port.bytes_in,
+                          "frames": port.frames,
+                          "stale": port.stale,
+                          "filtered": port.filtered,
+                          "lines_out": port.lines_out,
+                          "bytes_out": port.bytes_out,
+                          "callback_queue": len(dispatcher.events),
+                          "callback_queue_max": dispatcher.maxdepth,
+                          "callbacks_dropped": dispatcher.dropped,
+                          "callback_wait": dispatcher.waited.stats(),
+                          "callback_run": dispatcher.ran.stats(),
+                          "motor_queue": len(motorq.pending),
+                          "motor_dropped": motorq.dropped,
+                          "data_wait": self.datadone[p].histogram.stats(),
+                          "ramp_wait": self.rampdone[p].histogram.stats(),
+                          "pulse_wait": self.pulsedone[p].histogram.stats()})
+        return {"uptime": time.monotonic() - m.started,
+                "lines_in": m.lines_in,
+                "bytes_in": m.bytes_in,
+                "lines_out": m.lines_out,
+                "bytes_out": m.bytes_out,
+                "write_queue": self.writeq.qsize() if self.writeq is not None else 0,
+                "parse": m.parse.stats(),
+                "query_wait": {kind: hist.stats() for kind, hist in self.querywait.items()},
+                "ports": ports}
+
+    def query(self, kind, cmd, timeout=None):
+        """Send a command and wait for its reply
 
-    def loop(self, cond, uselist, q, listevt):
+        The firmware doesn't tag its replies, so they are matched to queries
+        of the same kind in the order they were sent. A query that times out
+        is forgotten, so a late reply to it answers the next query instead,
+        which is harmless as every query of a kind is the same command.
+
+        :param kind: Kind of query, one of QUERIES, such as "vin"
+        :param cmd: Command, such as b"vin\r"
+        :param timeout: Optional time in seconds to wait for the reply
+        :return: Value parsed from the reply
+        :raises BuildHATError: Occurs if the timeout passes first
+        """
+        q = self._send_query(kind, cmd)
+        try:
+            return q.done.wait(q.token, timeout)
+        except BuildHATError:
+            self._forget_query(kind, q)
+            raise
+        finally:
+            self.querywait[kind].observe(time.monotonic() - q.sent)
+
+    async def query_async(self, kind, cmd, timeout=None):
+        """Send a command and await its reply, as a coroutine
+
+        :param kind: Kind of query, one of QUERIES, such as "vin"
+        :param cmd: Command, such as b"vin\r"
+        :param timeout: Optional time in seconds to wait for the reply
+        :return: Value parsed from the reply
+        :raises BuildHATError: Occurs if the timeout passes first
+        """
+        import asyncio
+
+        q = self._send_query(kind, cmd)
+        try:
+            return await asyncio.wait_for(q.done.wait_async(q.token), timeout)
+        except asyncio.TimeoutError:
+            self._forget_query(kind, q)
+            raise BuildHATError("Timed out waiting for Build HAT")
+        finally:
+            self.querywait[kind].observe(time.monotonic() - q.sent)
+
+    def _send_query(self, kind, cmd):
+        q = Query()
+        # Queued in the same order the commands are written
+        with self.querylock:
+            if kind == "list" and len(self.queries[kind]) == 0:
+                # Anything collected belonged to a query that timed out
+                self.listreply = []
+            self.queries[kind].append(q)
+            self.write(cmd)
+        return q
+
+    def _forget_query(self, kind, q):
+        with self.querylock:
+            try:
+                self.queries[kind].remove(q)
+            except ValueError:
+                # Answered just as it timed out
+                pass
+
+    def _reply(self, kind, value):
+        with self.querylock:
+            pending = self.queries[kind]
+            if len(pending) == 0:
+                # Nobody asked, such as a reply meant for another buildhatd client
+                return
+            q = pending.popleft()
+        q.done.set(value)
+
+    def set_callback_policy(self, port, policy, maxlen=CallbackDispatcher.DEFAULT_MAXLEN):
+        """Set how callback events for a port are queued
+
+        :param port: Port number
+        :param policy: CallbackPolicy for when the queue is full
+        :param maxlen: Number of events that can wait to be delivered
+        """
+        self.dispatchers[port].configure(maxlen, policy)
+
+    def register_message(self, msg, handler):
+        """Register a handler for a port message from the firmware
+
+        :param msg: Message following the port prefix, such as ": ramp done"
+        :param handler: Function called with the port number and the whole line
+        """
+        self.portmsgs[msg] = handler
+
+    def register_line(self, line, handler):
+        """Register a handler for a line from the firmware that isn't for a port
+
+        :param line: Whole line, such as "Done initialising ports"
+        :param handler: Function called with the line
+        """
+        self.linemsgs[line] = handler
+
+    def add_tap(self, func):
+        """Call a function with every line read from the firmware, before it is handled
+
+        :param func: Function called with the line
+        """
+        self.taps = self.taps + (func,)
+
+    def remove_tap(self, func):
+        """Stop calling a function added with add_tap
+
+        :param func: Function to remove
+        """
+        self.taps = tuple(f for f in self.taps if f is not func)
+
+    def claim(self, port):
+        """Claim a port for this process, when sharing the HAT through buildhatd
+
+        :param port: Port number
+        :return: Whether the port was claimed
+        :raises BuildHATError: Occurs if buildhatd doesn't reply
+        """
+        if not self.shared:
+            return True
+        done = self.claimdone[port]
+        token = done.token()
+        self.write(f"{BuildHAT.CLAIM} {port}\r".encode())
+        return done.wait(token, BuildHAT.CLAIM_TIMEOUT)
+
+    def release(self, port):
+        """Release a port claimed with claim
+
+        :param port: Port number
+        """
+        if self.shared:
+            self.write(f"{BuildHAT.RELEASE} {port}\r".encode())
+
+    def observe(self, port, func):
+        """Call a function with each data frame from a port, whichever process selected its mode
+
+        Through buildhatd, the frames of a port claimed by another process
+        are forwarded to this one as well.
+
+        :param port: Port number
+        :param func: Function called from the serial reader thread with time.monotonic() of the frame
+                     and its data, or None to stop
+        """
+        conn = self.connections[port]
+        old = conn.observer
+        conn.observer = func
+        if self.shared and (old is None) != (func is None):
+            cmd = BuildHAT.OBSERVE if func is not None else BuildHAT.UNOBSERVE
+            self.write(f"{cmd} {port}\r".encode())
+
+    def _portmsg(self, portid, line):
+        msg = line[2:]
+        handler = self.portmsgs.get(msg)
+        if handler is None:
+            # Messages such as "connected to active ID 30" end with an argument
+            handler = self.portmsgs.get(msg.rsplit(" ", 1)[0])
+        if handler is not None:
+            handler(portid, line)
+
+    def startlist(self):
+        """Ask the firmware to list the devices on all ports"""
+        self.listcount = 0
+        self.listing = True
+        self.write(b"list\r")
+
+    def _listed(self, portid, typeid):
+        # Only called for the three lines a list reply is made of. A device
+        # plugged in later reports "disconnected", "established serial
+        # communication" and so on instead, except a passive device, whose
+        # "connected to passive ID" matches. The firmware lists the ports in
+        # order, so a line for any port but the next one is from hotplug
+        reply = None
+        with self.querylock:
+            if len(self.queries["list"]) > 0 and portid == len(self.listreply):
+                self.listreply.append(typeid)
+                if len(self.listreply) == 4:
+                    reply = self.listreply
+                    self.listreply = []
+        if reply is not None:
+            self._reply("list", reply)
+        if self.listing and portid == self.listcount:
+            self.listcount += 1
+            if self.listcount == 4:
+                self.listing = False
+                self._listdone()
+
+    def _listdone(self):
+        if not self.settling:
+            self._ready()
+            return
+        # Just rebooted, so devices may still be identifying themselves.
+        # List again until every port has a device, or nothing has changed
+        # for SETTLE_TIME
+        now = time.monotonic()
+        snapshot = tuple(conn.typeid for conn in self.connections)
+        if snapshot != self.snapshot:
+            self.snapshot = snapshot
+            self.stablesince = now
+        if -1 not in snapshot or now - self.stablesince >= BuildHAT.SETTLE_TIME or now >= self.deadline:
+            self.settling = False
+            self._ready()
+        else:
+            Timer(BuildHAT.LIST_INTERVAL, self.startlist).start()
+
+    def _ready(self):
+        if not self.readyevt.is_set():
+            self.mark("ready")
+            self.readyevt.set()
+
+    def _connected(self, portid, line):
+        typeid = int(line[2 + len(BuildHAT.CONNECTED):], 16)
+        self.connections[portid].update(typeid, True)
+        if typeid == 64:
+            self.write(f"port {portid} ; on\r".encode())
+        self._listed(portid, typeid)
+
+    def _connectedpassive(self, portid, line):
+        typeid = int(line[2 + len(BuildHAT.CONNECTEDPASSIVE):], 16)
+        self.connections[portid].update(typeid, True)
+        self._listed(portid, typeid)
+
+    def _lost(self, portid):
+        # Nothing more will arrive for anyone waiting on this port
+        error = DeviceError("Device disconnected")
+        self.datadone[portid].fail(error)
+        self.rampdone[portid].fail(error)
+        self.pulsedone[portid].fail(error)
+
+    def _disconnected(self, portid, line):
+        self.connections[portid].update(-1, False)
+        self._lost(portid)
+
+    def _notconnected(self, portid, line):
+        self.connections[portid].update(-1, False)
+        self._lost(portid)
+        self._listed(portid, -1)
+
+    def _rampdone(self, portid, line):
+        self.rampdone[portid].set()
+
+    def _pulsedone(self, portid, line):
+        self.pulsedone[portid].set()
+
+    def _claimed(self, line):
+        self.claimdone[int(line[-1])].set(line.startswith(BuildHAT.CLAIMED))
+
+    def _done(self, line):
+        if self.readyevt.is_set():
+            return
+        # Firmware has just booted
+        self.mark("boot")
+        self.snapshot = None
+        self.stablesince = time.monotonic()
+        self.deadline = self.stablesince + BuildHAT.STARTUP_TIMEOUT
+        self.settling = True
+        self.write(b"port 0 ; select ; port 1 ; select ; port 2 ; select ; port 3 ; select ; echo 0\r")
+        self.startlist()
+
+    def _data(self, portid, line):
+        conn = self.connections[portid]
+        port = self.metrics.ports[portid]
+        # Check data was for our current mode, before converting it
+        if line[2] == "M":
+            ours = conn.simplemode == int(line[3])
+        else:
+            ours = conn.combimode == int(line[3])
+        observer = conn.observer
+        if not ours and observer is None:
+            port.stale += 1
+            return
+        port.frames += 1
+        newdata = conn.decode(line[2:4], line[5:])
+        now = time.monotonic()
+        if not ours:
+            # Selected by another process, or before this one changed mode,
+            # so it mustn't be taken for a sample of the mode wanted here
+            observer(now, newdata)
+            return
+        callit = conn.callit
+        if callit is not None:
+            # Frames the callback would ignore are dropped here, rather than queued
+            for filt in conn.filters:
+                if not filt(now, newdata):
+                    port.filtered += 1
+                    break
+            else:
+                self.dispatchers[portid].put(callit, newdata)
+        conn.data = newdata
+        # Replaced as a whole, so readers never see a half updated sample
+        conn.sample = (now, newdata)
+        ring = conn.ring
+        if ring is not None:
+            ring.append(now, newdata)
+        for func in conn.listeners:
+            func(now, newdata)
+        if observer is not None:
+            observer(now, newdata)
+        self.datadone[portid].set(newdata)
+
+    def _vin(self, line):
+        self._reply("vin", float(line.split(" ")[0]))
+
+    def loop(self):
         """Event handling for Build HAT
 
-        :param cond: Condition used to block user's script till we're ready
-        :param uselist: Whether we're using the HATs 'list' function or not
-        :param q: Queue for callback events
+        Lines for a port are dispatched on the character following the port
+        number, so data frames reach their handler without being compared
+        against every status message first.
         """
-        count = 0
+        frames = self.frames
+        linemsgs = self.linemsgs
+        ports = self.metrics.ports
+        parse = self.metrics.parse
         while self.running:
-            line = self.read()
-            if len(line) == 0:
+            lines = self.readlines()
+            if len(lines) == 0:
                 continue
-            if line[0] == "P" and line[2] == ":":
-                portid = int(line[1])
-                msg = line[2:]
-                if cmp(msg, BuildHAT.CONNECTED):
-                    typeid = int(line[2 + len(BuildHAT.CONNECTED):], 16)
-                    self.connections[portid].update(typeid, True)
-                    if typeid == 64:
-                        self.write(f"port {portid} ; on\r".encode())
-                    if uselist and listevt.is_set():
-                        count += 1
-                elif cmp(msg, BuildHAT.CONNECTEDPASSIVE):
-                    typeid = int(line[2 + len(BuildHAT.CONNECTEDPASSIVE):], 16)
-                    self.connections[portid].update(typeid, True)
-                    if uselist and listevt.is_set():
-                        count += 1
-                elif cmp(msg, BuildHAT.DISCONNECTED):
-                    self.connections[portid].update(-1, False)
-                elif cmp(msg, BuildHAT.DEVTIMEOUT):
-                    self.connections[portid].update(-1, False)
-                elif cmp(msg, BuildHAT.NOTCONNECTED):
-                    self.connections[portid].update(-1, False)
-                    if uselist and listevt.is_set():
-                        count += 1
-                elif cmp(msg, BuildHAT.RAMPDONE):
-                    ftr = self.rampftr[portid].pop()
-                    ftr.set_result(True)
-                elif cmp(msg, BuildHAT.PULSEDONE):
-                    ftr = self.pulseftr[portid].pop()
-                    ftr.set_result(True)
-
-            if uselist and count == 4:
-                with cond:
-                    uselist = False
-                    cond.notify()
-
-            if not uselist and cmp(line, BuildHAT.DONE):
-                def runit():
-                    with cond:
-                        cond.notify()
-                t = Timer(8.0, runit)
-                t.start()
-
-            if line[0] == "P" and (line[2] == "C" or line[2] == "M"):
-                portid = int(line[1])
-                data = line[5:].split(" ")
-                newdata = []
-                for d in data:
-                    if "." in d:
-                        newdata.append(float(d))
-                    else:
-                        if d != "":
-                            newdata.append(int(d))
-                # Check data was for our current mode
-                if line[2] == "M" and self.connections[portid].simplemode != int(line[3]):
+            start = time.monotonic()
+            for line in lines:
+                if len(line) < 3:
                     continue
-                elif line[2] == "C" and self.connections[portid].combimode != int(line[3]):
-                    continue
-                callit = self.connections[portid].callit
-                if callit is not None:
-                    q.put((callit, newdata))
-                self.connections[portid].data = newdata
-                try:
-                    ftr = self.portftr[portid].pop()
-                    ftr.set_result(newdata)
-                except IndexError:
-                    pass
-
-            if len(line) >= 5 and line[1] == "." and line.endswith(" V"):
-                vin = float(line.split(" ")[0])
-                ftr = self.vinftr.pop()
-                ftr.set_result(vin)
+                for tap in self.taps:
+                    tap(line)
+                if line[0] == "P":
+                    handler = frames.get(line[2])
+                    if handler is not None:
+                        portid = int(line[1])
+                        port = ports[portid]
+                        port.lines_in += 1
+                        port.bytes_in += len(line) + 2
+                        handler(portid, line)
+                        continue
+                handler = linemsgs.get(line)
+                if handler is not None:
+                    handler(line)
+                elif line[1] == "." and line.endswith(" V") and len(line) >= 5:
+                    self._vin(line)
+                elif line.startswith(BuildHAT.FIRMWARE):
+                    self._reply("version", line[len(BuildHAT.FIRMWARE):])
+            parse.observe((time.monotonic() - start) / len(lines))
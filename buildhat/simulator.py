@@ -0,0 +1,276 @@
+"""Simulated Build HAT, for running and benchmarking without hardware"""
+
+import os
+import sys
+import threading
+import time
+
+# Type IDs of devices attached to each port by default
+DEFAULT_DEVICES = {0: 48, 1: 49, 2: 61, 3: 62}
+
+MOTORS = {38, 46, 47, 48, 49, 65, 75, 76}
+
+# Number of values in simple modes the library uses, otherwise there is one
+VALUES = {(37, 6): 3,
+          (61, 5): 4,
+          (61, 6): 3,
+          (63, 0): 1}
+
+
+class SimulatedSerial:
+    """Serial-like connection to a simulated Build HAT running the firmware
+
+    Answers enough of the firmware's commands for the library to start up,
+    stream data from selected modes, and complete ramps and pulses. Lines
+    can also be injected or replayed, as if read from a real Build HAT,
+    such as ones recorded from its debug log.
+
+    For example ``Hat(device=SimulatedSerial())``
+
+    :param devices: Optional dictionary of port number to type ID
+    :param version: Optional firmware version to report, otherwise the one the library expects
+    :param rate: Optional frames per second to stream selected modes at, otherwise their selrate
+    :param speedup: Optional factor by which ramps and pulses finish faster than real time
+    """
+
+    def __init__(self, devices=None, version=None, rate=None, speedup=1):
+        """Start simulated Build HAT
+
+        :param devices: Optional dictionary of port number to type ID
+        :param version: Optional firmware version to report, otherwise the one the library expects
+        :param rate: Optional frames per second to stream selected modes at, otherwise their selrate
+        :param speedup: Optional factor by which ramps and pulses finish faster than real time
+        """
+        if version is None:
+            data = os.path.join(os.path.dirname(sys.modules["buildhat"].__file__), "data/version")
+            with open(data) as vfile:
+                version = int(vfile.read())
+        self.version = version
+        self.devices = dict(DEFAULT_DEVICES if devices is None else devices)
+        self.rate = rate
+        self.speedup = speedup
+        self.baudrate = 115200
+        self.timeout = None
+        self.out = bytearray()
+        self.cond = threading.Condition()
+        self.inbuf = bytearray()
+        self.written = 0
+        self.port = 0
+        self.selected = {}
+        self.combis = {p: {} for p in range(4)}
+        self.pos = {p: 0.0 for p in range(4)}
+        self.closed = False
+        self.th = threading.Thread(target=self._stream)
+        self.th.daemon = True
+        self.th.start()
+
+    @property
+    def in_waiting(self):
+        """Number of bytes waiting to be read
+
+        :return: Number of bytes
+        """
+        with self.cond:
+            return len(self.out)
+
+    def read(self, size=1):
+        """Read bytes, waiting up to the timeout for at least one
+
+        :param size: Most bytes to read
+        :return: Bytes read
+        """
+        with self.cond:
+            self.cond.wait_for(lambda: len(self.out) > 0 or self.closed, self.timeout)
+            data = bytes(self.out[:size])
+            del self.out[:size]
+            return data
+
+    def readline(self):
+        """Read a line, waiting up to the timeout for it
+
+        :return: Bytes read, up to and including the newline
+        """
+        with self.cond:
+            self.cond.wait_for(lambda: b"\n" in self.out or self.closed, self.timeout)
+            end = self.out.find(b"\n")
+            end = len(self.out) if end == -1 else end + 1
+            data = bytes(self.out[:end])
+            del self.out[:end]
+            return data
+
+    def write(self, data):
+        """Handle commands sent to the firmware
+
+        :param data: Bytes of commands
+        :return: Number of bytes written
+        """
+        self.written += len(data)
+        self.inbuf += data
+        while True:
+            end = self.inbuf.find(b"\r")
+            if end == -1:
+                break
+            line = self.inbuf[:end].decode("utf-8", "ignore")
+            del self.inbuf[:end + 1]
+            for cmd in line.split(";"):
+                try:
+                    self._command(cmd.split())
+                except (ValueError, IndexError):
+                    # The firmware ignores malformed commands too
+                    pass
+        return len(data)
+
+    def flush(self):
+        """Nothing is buffered"""
+
+    def reset_input_buffer(self):
+        """Discard lines not yet read"""
+        with self.cond:
+            self.out.clear()
+
+    def close(self):
+        """Stop the simulated Build HAT"""
+        with self.cond:
+            self.closed = True
+            self.cond.notify_all()
+
+    def inject(self, lines):
+        """Make lines available to read straight away, as if sent by the firmware
+
+        :param lines: Lines, without line endings
+        """
+        data = "".join(f"{line}\r\n" for line in lines).encode()
+        with self.cond:
+            self.out += data
+            self.cond.notify_all()
+
+    def replay(self, lines, rate=None, loop=False):
+        """Send lines in the background, as if sent by the firmware
+
+        Lines can also be (timestamp, line) pairs, such as from
+        TraceReader.lines(), which are sent with the spacing they were
+        recorded with unless a rate is given.
+
+        :param lines: Lines, without line endings, such as those recorded from a debug log
+        :param rate: Optional lines per second, otherwise as fast as they are read
+        :param loop: Whether to keep replaying the lines until closed
+        :return: Thread replaying the lines
+        """
+        lines = [entry if isinstance(entry, tuple) else (None, entry) for entry in lines]
+        if rate is not None or any(when is None for when, _ in lines):
+            lines = [(None if rate is None else n / rate, line) for n, (_, line) in enumerate(lines)]
+        else:
+            lines = [(when - lines[0][0], line) for when, line in lines]
+
+        def run():
+            while not self.closed:
+                start = time.monotonic()
+                for when, line in lines:
+                    if self.closed:
+                        return
+                    if when is not None:
+                        delay = start + when - time.monotonic()
+                        if delay > 0:
+                            time.sleep(delay)
+                    self.inject([line])
+                if not loop:
+                    return
+
+        th = threading.Thread(target=run)
+        th.daemon = True
+        th.start()
+        return th
+
+    def replay_trace(self, path, rate=None, loop=False):
+        """Send the lines received in a binary trace, as if sent by the firmware
+
+        :param path: Path of a trace file written with Hat(trace=...)
+        :param rate: Optional lines per second, otherwise with the spacing they were recorded with
+        :param loop: Whether to keep replaying the lines until closed
+        :return: Thread replaying the lines
+        """
+        from .trace import TraceReader
+
+        return self.replay(TraceReader(path).lines(), rate, loop)
+
+    def _emit(self, line):
+        self.inject([line])
+
+    def _command(self, words):
+        if len(words) == 0:
+            return
+        cmd = words[0]
+        port = self.port
+        if cmd == "version":
+            self._emit(f"Firmware version: {self.version} 2023-01-27T11:20:21+00:00")
+        elif cmd == "list":
+            self._list()
+        elif cmd == "vin":
+            self._emit("7.500 V")
+        elif cmd == "port":
+            self.port = int(words[1])
+        elif cmd == "select":
+            if len(words) == 1:
+                self.selected.pop(port, None)
+            else:
+                interval = self.selected.get(port, (0, 10))[1]
+                self.selected[port] = (int(words[1]), interval)
+        elif cmd == "selrate":
+            if port in self.selected:
+                self.selected[port] = (self.selected[port][0], max(int(words[1]), 1))
+        elif cmd == "combi":
+            if len(words) > 2:
+                pairs = [int(w) for w in words[2:]]
+                self.combis[port][int(words[1])] = list(zip(pairs[0::2], pairs[1::2]))
+            else:
+                self.combis[port].pop(int(words[1]), None)
+        elif cmd == "set" and len(words) > 1 and words[1] == "ramp":
+            target, duration = float(words[3]), float(words[4])
+
+            def done():
+                self.pos[port] = target * 360
+                self._emit(f"P{port}: ramp done")
+            threading.Timer(duration / self.speedup, done).start()
+        elif cmd == "set" and len(words) > 1 and words[1] == "pulse":
+            threading.Timer(float(words[4]) / self.speedup, lambda: self._emit(f"P{port}: pulse done")).start()
+
+    def _list(self):
+        for p in range(4):
+            typeid = self.devices.get(p)
+            if typeid is None:
+                self._emit(f"P{p}: no device detected")
+            else:
+                self._emit(f"P{p}: connected to active ID {typeid:x}")
+
+    def _value(self, port, mode, dataset):
+        """Value of one dataset of a mode on a simulated device"""
+        if self.devices.get(port) in MOTORS:
+            pos = int(self.pos[port])
+            return (0, pos, (pos + 180) % 360 - 180)[mode - 1] if 1 <= mode <= 3 else 0
+        return (mode * 16 + dataset * 4 + int(time.monotonic() * 10)) % 100
+
+    def _frame(self, port, mode):
+        combi = self.combis[port].get(mode)
+        if combi is not None:
+            values = [self._value(port, m, d) for m, d in combi]
+            return f"P{port}C{mode}: " + " ".join(str(v) for v in values) + " "
+        count = VALUES.get((self.devices.get(port), mode), 1)
+        return f"P{port}M{mode}: " + " ".join(str(self._value(port, mode, d)) for d in range(count)) + " "
+
+    def _stream(self):
+        due = {}
+        while not self.closed:
+            now = time.monotonic()
+            lines = []
+            for port, (mode, interval) in list(self.selected.items()):
+                period = 1 / self.rate if self.rate is not None else interval / 1000
+                when = due.get(port, now)
+                if when <= now:
+                    lines.append(self._frame(port, mode))
+                    due[port] = max(when + period, now - period)
+            for port in list(due):
+                if port not in self.selected:
+                    del due[port]
+            if len(lines) > 0:
+                self.inject(lines)
+            time.sleep(0.001)
@@ -0,0 +1,171 @@
+"""Shared memory snapshot of the latest data from each port"""
+
+import struct
+from collections import namedtuple
+from functools import partial
+
+# Values in the data mode each device sets when it is created
+LAYOUTS = {34: ("x", "y"),                                   # TiltSensor
+           35: ("distance",),                                # MotionSensor
+           37: ("distance", "reflected",
+                "red", "green", "blue"),                     # ColorDistanceSensor
+           38: ("speed", "pos"),                             # Motor
+           46: ("speed", "pos", "apos"),
+           47: ("speed", "pos", "apos"),
+           48: ("speed", "pos", "apos"),
+           49: ("speed", "pos", "apos"),
+           61: ("red", "green", "blue", "intensity"),        # ColorSensor
+           62: ("distance",),                                # DistanceSensor
+           63: ("force", "pressed", "peak"),                 # ForceSensor
+           65: ("speed", "pos", "apos"),
+           75: ("speed", "pos", "apos"),
+           76: ("speed", "pos", "apos")}
+
+DEFAULT_NAME = "buildhat"
+MAGIC = b"BHS1"
+MAX_VALUES = 8
+HEADER = struct.Struct("<4sII")
+SEQ = struct.Struct("<I")
+BODY = struct.Struct(f"<iiiIxxxxd{MAX_VALUES}d")
+SLOT_SIZE = SEQ.size + BODY.size
+SIZE = HEADER.size + 4 + 4 * SLOT_SIZE
+
+Snapshot = namedtuple("Snapshot", ["typeid", "simplemode", "combimode", "timestamp", "values"])
+
+
+def slot_offset(port):
+    """Offset of a port's slot in the shared memory block
+
+    A slot is a uint32 sequence number, then int32 typeid, simple mode and
+    combi mode, uint32 count of values, 4 bytes padding, the float64
+    time.monotonic() of the frame and MAX_VALUES float64 values.
+
+    :param port: Port number
+    :return: Offset in bytes
+    """
+    return HEADER.size + 4 + port * SLOT_SIZE
+
+
+class SnapshotWriter:
+    """Publishes the latest data frame from each port into shared memory
+
+    Frames are written from the serial reader thread under a seqlock: the
+    sequence number of a slot is odd while it is being written, so readers
+    in other processes retry rather than see a half written frame.
+
+    :param hat: BuildHAT to publish data from
+    :param name: Name of shared memory block
+    """
+
+    def __init__(self, hat, name=DEFAULT_NAME):
+        """Create shared memory block and start publishing
+
+        :param hat: BuildHAT to publish data from
+        :param name: Name of shared memory block
+        """
+        from multiprocessing import shared_memory
+
+        self.hat = hat
+        self.shm = shared_memory.SharedMemory(name=name, create=True, size=SIZE)
+        self.buf = self.shm.buf
+        self.buf[:SIZE] = bytes(SIZE)
+        HEADER.pack_into(self.buf, 0, MAGIC, 4, MAX_VALUES)
+        self.seqs = [0] * 4
+        self.listeners = []
+        for port, conn in enumerate(hat.connections):
+            func = partial(self._publish, port, conn)
+            conn.add_listener(func)
+            self.listeners.append((conn, func))
+
+    def _publish(self, port, conn, now, values):
+        off = slot_offset(port)
+        count = min(len(values), MAX_VALUES)
+        padded = list(values[:count]) + [0.0] * (MAX_VALUES - count)
+        seq = (self.seqs[port] + 1) & 0xFFFFFFFF
+        SEQ.pack_into(self.buf, off, seq)
+        BODY.pack_into(self.buf, off + SEQ.size, conn.typeid, conn.simplemode, conn.combimode, count, now, *padded)
+        self.seqs[port] = (seq + 1) & 0xFFFFFFFF
+        SEQ.pack_into(self.buf, off, self.seqs[port])
+
+    def close(self):
+        """Stop publishing and remove the shared memory block"""
+        for conn, func in self.listeners:
+            conn.remove_listener(func)
+        self.listeners = []
+        self.buf = None
+        self.shm.close()
+        self.shm.unlink()
+
+
+class SnapshotReader:
+    """Reads the latest data from each port, as published by SnapshotWriter
+
+    Reading needs no round trip to the process owning the Build HAT. For
+    numpy, the values of a port can be viewed directly, for example
+    ``numpy.ndarray(MAX_VALUES, numpy.float64, reader.buf, slot_offset(port) + 32)``,
+    though only read() checks the seqlock.
+
+    :param name: Name of shared memory block
+    :raises ValueError: Occurs if the block was not created by SnapshotWriter
+    """
+
+    def __init__(self, name=DEFAULT_NAME):
+        """Attach to shared memory block
+
+        :param name: Name of shared memory block
+        :raises ValueError: Occurs if the block was not created by SnapshotWriter
+        """
+        from multiprocessing import shared_memory
+
+        try:
+            self.shm = shared_memory.SharedMemory(name=name, track=False)
+        except TypeError:
+            # Before Python 3.13 attaching registers the block for removal
+            # when this process exits, which would pull it from the writer
+            from multiprocessing import resource_tracker
+
+            self.shm = shared_memory.SharedMemory(name=name)
+            resource_tracker.unregister(self.shm._name, "shared_memory")
+        self.buf = self.shm.buf
+        magic, ports, maxvalues = HEADER.unpack_from(self.buf, 0)
+        if magic != MAGIC or maxvalues != MAX_VALUES:
+            raise ValueError("Not a Build HAT snapshot")
+
+    def read(self, port):
+        """Read the latest frame from a port
+
+        :param port: Port number
+        :return: Snapshot of typeid, modes, timestamp and values, or None if no data has arrived
+        """
+        off = slot_offset(port)
+        while True:
+            seq = SEQ.unpack_from(self.buf, off)[0]
+            if seq & 1:
+                continue
+            body = BODY.unpack_from(self.buf, off + SEQ.size)
+            if SEQ.unpack_from(self.buf, off)[0] == seq:
+                break
+        if seq == 0:
+            return None
+        typeid, simplemode, combimode, count, timestamp = body[:5]
+        return Snapshot(typeid, simplemode, combimode, timestamp, body[5:5 + count])
+
+    def fields(self, port):
+        """Read the latest frame from a port, by name of value
+
+        :param port: Port number
+        :return: Dictionary of values, or None if there is no data or no layout for the device
+        """
+        snap = self.read(port)
+        if snap is None or snap.typeid not in LAYOUTS:
+            return None
+        names = LAYOUTS[snap.typeid]
+        if len(names) != len(snap.values):
+            # Device is in a mode other than its default
+            return None
+        return dict(zip(names, snap.values))
+
+    def close(self):
+        """Detach from shared memory block"""
+        self.buf = None
+        self.shm.close()
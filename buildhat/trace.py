@@ -0,0 +1,203 @@
+"""Binary trace of the bytes sent to and received from a Build HAT
+
+Records go into a fixed number of slots in a memory-mapped file, used as
+a ring, so tracing can be left on without the file growing or the
+formatting cost of debug logging. Each slot holds a sequence number, a
+time.monotonic() timestamp, a direction and up to SLOT_DATA bytes; longer
+writes and reads continue into following slots.
+
+Render a trace with::
+
+    python3 -m buildhat.trace buildhat.trace
+"""
+
+import argparse
+import mmap
+import os
+import struct
+import threading
+import time
+
+MAGIC = b"BHTR"
+VERSION = 1
+
+# Magic, version, number of slots, next sequence number, time.time() - time.monotonic()
+HEADER = struct.Struct("<4sIIQd")
+HEADER_SIZE = 64
+
+# Sequence number, timestamp, flags, length
+SLOT = struct.Struct("<QdBB")
+SLOT_SIZE = 64
+SLOT_DATA = SLOT_SIZE - SLOT.size
+
+RECEIVED = 0
+SENT = 1
+_CONTINUED = 2
+
+DEFAULT_SIZE = 4 * 1024 * 1024
+
+
+class TraceWriter:
+    """Records bytes into a memory-mapped ring file
+
+    :param path: Path of trace file, which is replaced
+    :param size: Optional size of file in bytes
+    """
+
+    def __init__(self, path, size=DEFAULT_SIZE):
+        """Create trace file
+
+        :param path: Path of trace file, which is replaced
+        :param size: Optional size of file in bytes
+        """
+        self.path = path
+        self.slots = max(1, (size - HEADER_SIZE) // SLOT_SIZE)
+        self.seq = 1
+        self.lock = threading.Lock()
+        fd = os.open(path, os.O_RDWR | os.O_CREAT | os.O_TRUNC, 0o644)
+        try:
+            os.ftruncate(fd, HEADER_SIZE + self.slots * SLOT_SIZE)
+            self.mm = mmap.mmap(fd, HEADER_SIZE + self.slots * SLOT_SIZE)
+        finally:
+            os.close(fd)
+        self.epoch = time.time() - time.monotonic()
+        self._header()
+
+    def _header(self):
+        HEADER.pack_into(self.mm, 0, MAGIC, VERSION, self.slots, self.seq, self.epoch)
+
+    def record(self, direction, data, now=None):
+        """Record bytes
+
+        :param direction: RECEIVED or SENT
+        :param data: Bytes
+        :param now: Optional time.monotonic() the bytes were sent or received
+        """
+        if now is None:
+            now = time.monotonic()
+        mm = self.mm
+        with self.lock:
+            if mm is None:
+                return
+            flags = direction
+            for i in range(0, max(len(data), 1), SLOT_DATA):
+                chunk = data[i:i + SLOT_DATA]
+                off = HEADER_SIZE + (self.seq % self.slots) * SLOT_SIZE
+                SLOT.pack_into(mm, off, self.seq, now, flags, len(chunk))
+                mm[off + SLOT.size:off + SLOT.size + len(chunk)] = chunk
+                self.seq += 1
+                flags = direction | _CONTINUED
+            struct.pack_into("<Q", mm, 12, self.seq)
+
+    def received(self, data):
+        """Record bytes read from the Build HAT
+
+        :param data: Bytes
+        """
+        self.record(RECEIVED, data)
+
+    def sent(self, data):
+        """Record bytes written to the Build HAT
+
+        :param data: Bytes
+        """
+        self.record(SENT, data)
+
+    def close(self):
+        """Stop recording, leaving the file to be decoded"""
+        with self.lock:
+            if self.mm is not None:
+                self._header()
+                self.mm.close()
+                self.mm = None
+
+
+class TraceReader:
+    """Decodes a trace file written by TraceWriter
+
+    :param path: Path of trace file
+    :raises ValueError: Occurs if the file isn't a trace
+    """
+
+    def __init__(self, path):
+        """Read trace file
+
+        :param path: Path of trace file
+        :raises ValueError: Occurs if the file isn't a trace
+        """
+        with open(path, "rb") as f:
+            self.buf = f.read()
+        if len(self.buf) < HEADER.size:
+            raise ValueError("Not a Build HAT trace")
+        magic, version, self.slots, self.seq, self.epoch = HEADER.unpack_from(self.buf, 0)
+        if magic != MAGIC or version != VERSION:
+            raise ValueError("Not a Build HAT trace")
+
+    def records(self):
+        """Records from oldest to newest, rejoining bytes split across slots
+
+        A record whose first slot has been overwritten is skipped.
+
+        :return: Iterator of (timestamp, direction, bytes)
+        """
+        first = max(1, self.seq - self.slots)
+        current = None
+        for seq in range(first, self.seq):
+            off = HEADER_SIZE + (seq % self.slots) * SLOT_SIZE
+            got, now, flags, length = SLOT.unpack_from(self.buf, off)
+            if got != seq:
+                # Being written when the trace was read
+                continue
+            data = self.buf[off + SLOT.size:off + SLOT.size + length]
+            if flags & _CONTINUED:
+                if current is not None:
+                    current[2] += data
+                continue
+            if current is not None:
+                yield tuple(current)
+            current = [now, flags & SENT, data]
+        if current is not None:
+            yield tuple(current)
+
+    def lines(self, direction=RECEIVED):
+        """Lines in one direction, such as for SimulatedSerial.replay()
+
+        :param direction: RECEIVED or SENT
+        :return: List of (timestamp, line), without line endings
+        """
+        lines = []
+        partial = b""
+        for now, way, data in self.records():
+            if way != direction:
+                continue
+            partial += data
+            *complete, partial = partial.replace(b"\r", b"\n").split(b"\n")
+            for line in complete:
+                line = line.decode("utf-8", "ignore").strip()
+                if line != "":
+                    lines.append((now, line))
+        return lines
+
+
+def main():
+    """Render a trace file as text"""
+    parser = argparse.ArgumentParser(description="Render a Build HAT trace")
+    parser.add_argument("path", help="Trace file")
+    parser.add_argument("--raw", action="store_true", help="Show each read and write, rather than lines")
+    parser.add_argument("--wall", action="store_true", help="Show wall clock times, rather than monotonic")
+    args = parser.parse_args()
+    trace = TraceReader(args.path)
+    offset = trace.epoch if args.wall else 0
+    if args.raw:
+        for now, way, data in trace.records():
+            print(f"{now + offset:.6f} {'>' if way == SENT else '<'} {data!r}")
+        return
+    lines = [(now, "<", line) for now, line in trace.lines(RECEIVED)]
+    lines += [(now, ">", line) for now, line in trace.lines(SENT)]
+    lines.sort(key=lambda entry: entry[0])
+    for now, way, line in lines:
+        print(f"{now + offset:.6f} {way} {line}")
+
+
+if __name__ == "__main__":
+    main()
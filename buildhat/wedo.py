@@ -7,16 +7,18 @@ class TiltSensor(Device):
     """Tilt sensor
 
     :param port: Port of device
+    :param hat: Optional Hat the device is attached to, otherwise the first one
     :raises DeviceError: Occurs if there is no tilt sensor attached to port
     """
 
-    def __init__(self, port):
+    def __init__(self, port, hat=None):
         """
         Initialise tilt sensor
 
         :param port: Port of device
+        :param hat: Optional Hat the device is attached to, otherwise the first one
         """
-        super().__init__(port)
+        super().__init__(port, hat)
         self.mode(0)
 
     def get_tilt(self):
@@ -33,18 +35,20 @@ class MotionSensor(Device):
     """Motion sensor
 
     :param port: Port of device
+    :param hat: Optional Hat the device is attached to, otherwise the first one
     :raises DeviceError: Occurs if there is no motion sensor attached to port
     """
 
     default_mode = 0
 
-    def __init__(self, port):
+    def __init__(self, port, hat=None):
         """
         Initialise motion sensor
 
         :param port: Port of device
+        :param hat: Optional Hat the device is attached to, otherwise the first one
         """
-        super().__init__(port)
+        super().__init__(port, hat)
         self.mode(self.default_mode)
 
     def set_default_data_mode(self, mode):
@@ -0,0 +1,11 @@
+"""Example for group of motors"""
+
+from buildhat import MotorGroup
+
+group = MotorGroup('A', 'B', 'C')
+group.set_default_speed(20)
+group.run_for_rotations(2)
+
+group.run_for_degrees(180, speeds=[20, 40, -20])
+
+group.run_to_position([0, 90, -90], speed=20)
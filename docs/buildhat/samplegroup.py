@@ -0,0 +1,16 @@
+"""Example for sampling a force sensor and motor together"""
+
+from buildhat import ForceSensor, Motor, SampleGroup
+
+force = ForceSensor('A')
+motor = Motor('B')
+motor.start(20)
+
+with SampleGroup(force, motor, interval=20) as group:
+    for sample in group:
+        (newtons, pressed, peak), (speed, pos, apos) = sample.values
+        print(f"{sample.timestamp:.3f} force {newtons} at position {pos}")
+        if pressed:
+            break
+
+motor.stop()
@@ -28,5 +28,8 @@ setup(name='buildhat',
       package_data={
           "": ["data/firmware.bin", "data/signature.bin", "data/version"],
       },
+      entry_points={
+          "console_scripts": ["buildhatd = buildhat.daemon:main"],
+      },
       python_requires='>=3.7',
       install_requires=['gpiozero', 'pyserial'])
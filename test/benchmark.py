@@ -0,0 +1,259 @@
+"""Benchmark the library against a simulated Build HAT
+
+Runs without hardware, for measuring performance work locally:
+
+    python3 test/benchmark.py
+    python3 test/benchmark.py --replay buildhat-debug.log --rate 20000
+    python3 test/benchmark.py --replay buildhat.trace
+"""
+
+import argparse
+import os
+import statistics
+import subprocess
+import sys
+import threading
+import time
+
+from buildhat import Hat, Motor
+from buildhat.devices import Device
+from buildhat.simulator import SimulatedSerial
+from buildhat.trace import MAGIC, TraceReader
+
+
+# Run in a fresh interpreter, so that nothing has been imported yet
+FOOTPRINT = """
+import resource, threading, time
+start = time.monotonic()
+import buildhat
+imported = time.monotonic() - start
+from buildhat.simulator import SimulatedSerial
+hat = buildhat.Hat(device=SimulatedSerial())
+buildhat.Motor('A').get_position()
+print(imported, time.monotonic() - start, resource.getrusage(resource.RUSAGE_SELF).ru_maxrss, threading.active_count())
+"""
+
+
+def report(name, values, unit):
+    """Print summary of measurements
+
+    :param name: Name of measurement
+    :param values: List of measurements
+    :param unit: Unit of measurements
+    """
+    values = sorted(values)
+    p99 = values[min(len(values) - 1, int(len(values) * 0.99))]
+    print(f"{name:<28} mean {statistics.mean(values):10.1f}  p50 {statistics.median(values):10.1f}  "
+          f"p99 {p99:10.1f} {unit}")
+
+
+class Counter:
+    """Counts data frames as the serial reader parses them"""
+
+    def __init__(self, total):
+        """Initialise counter
+
+        :param total: Number of frames to wait for
+        """
+        self.total = total
+        self.count = 0
+        self.done = threading.Event()
+
+    def __call__(self, now, data):
+        """Count frame
+
+        :param now: Time frame arrived
+        :param data: Values in frame
+        """
+        self.count += 1
+        if self.count == self.total:
+            self.done.set()
+
+
+class Latency:
+    """Records how long frames take to reach a callback"""
+
+    def __init__(self):
+        """Initialise latencies"""
+        self.sent = {}
+        self.latencies = []
+
+    def handle(self, data):
+        """Record latency of frame
+
+        :param data: Frame, with its sequence number as the second value
+        """
+        sent = self.sent.pop(data[1], None)
+        if sent is not None:
+            self.latencies.append((time.monotonic() - sent) * 1e6)
+
+
+def footprint():
+    """Import time, startup time, peak RSS and threads of a script reading one motor
+
+    :return: Seconds to import, seconds to read the motor, peak RSS in kilobytes, number of threads
+    """
+    env = dict(os.environ, PYTHONPATH=os.pathsep.join(p for p in sys.path if p != ""))
+    out = subprocess.run([sys.executable, "-c", FOOTPRINT], env=env, capture_output=True, text=True, check=True).stdout
+    imported, started, rss, threads = out.split()
+    # The simulator streams from a thread of its own
+    return float(imported), float(started), int(rss), int(threads) - 1
+
+
+def parse_throughput(sim, motor, frames):
+    """Lines per second parsed by the serial reader
+
+    :param sim: SimulatedSerial
+    :param motor: Motor on port A
+    :param frames: Number of frames
+    :return: Lines per second
+    """
+    motor.deselect()
+    counter = Counter(frames)
+    conn = motor._conn
+    conn.add_listener(counter)
+    lines = [f"P0C0: {i % 100} {i} {i % 360}" for i in range(frames)]
+    start = time.monotonic()
+    sim.inject(lines)
+    counter.done.wait(60)
+    elapsed = time.monotonic() - start
+    conn.remove_listener(counter)
+    return counter.count / elapsed
+
+
+def replay_throughput(sim, lines, rate):
+    """Lines per second parsed from a recording
+
+    :param sim: SimulatedSerial
+    :param lines: Recorded lines
+    :param rate: Optional lines per second to replay at
+    :return: Lines per second
+    """
+    seen = [0]
+    end = threading.Event()
+    total = len(lines)
+
+    def tap(line):
+        seen[0] += 1
+        if seen[0] >= total:
+            end.set()
+
+    hat = Device._instance
+    hat.add_tap(tap)
+    start = time.monotonic()
+    sim.replay(lines, rate).join()
+    end.wait(10)
+    elapsed = time.monotonic() - start
+    hat.remove_tap(tap)
+    return seen[0] / elapsed
+
+
+def callback_latency(sim, motor, frames, rate):
+    """Time from a frame arriving to its callback running
+
+    :param sim: SimulatedSerial
+    :param motor: Motor on port A
+    :param frames: Number of frames
+    :param rate: Frames per second
+    :return: List of latencies in microseconds
+    """
+    latency = Latency()
+    motor.set_filters()
+    motor.callback(latency.handle)
+    motor.deselect()
+    for i in range(frames):
+        latency.sent[i] = time.monotonic()
+        sim.inject([f"P0C0: 0 {i} 0"])
+        time.sleep(1 / rate)
+    time.sleep(0.1)
+    motor.callback(None)
+    return latency.latencies
+
+
+def round_trip(hat, count):
+    """Time for a command to be answered
+
+    :param hat: Hat
+    :param count: Number of commands
+    :return: List of round trip times in microseconds
+    """
+    times = []
+    for _ in range(count):
+        start = time.monotonic()
+        hat.get_vin()
+        times.append((time.monotonic() - start) * 1e6)
+    return times
+
+
+def get_latency(motor, count):
+    """Time for get() to return the next frame, with frames every millisecond
+
+    :param motor: Motor
+    :param count: Number of frames
+    :return: List of times in microseconds
+    """
+    motor.interval = 1
+    motor.select()
+    times = []
+    for _ in range(count):
+        start = time.monotonic()
+        motor.get()
+        times.append((time.monotonic() - start) * 1e6)
+    return times
+
+
+def load_recording(path):
+    """Read lines received from a Build HAT, from a binary trace, debug log or plain text
+
+    :param path: Path of file
+    :return: List of lines
+    """
+    with open(path, "rb") as f:
+        if f.read(len(MAGIC)) == MAGIC:
+            return [line for _, line in TraceReader(path).lines()]
+    lines = []
+    with open(path) as f:
+        for line in f:
+            if " < " in line:
+                line = line.split(" < ", 1)[1]
+            elif " > " in line:
+                continue
+            line = line.strip()
+            if line != "":
+                lines.append(line)
+    return lines
+
+
+def main():
+    """Run benchmarks"""
+    parser = argparse.ArgumentParser(description="Benchmark against a simulated Build HAT")
+    parser.add_argument("--frames", type=int, default=100000, help="Frames for parser throughput")
+    parser.add_argument("--count", type=int, default=500, help="Samples for latency measurements")
+    parser.add_argument("--rate", type=float, default=None, help="Lines per second to replay at")
+    parser.add_argument("--replay", metavar="FILE", help="Also replay lines recorded from a Build HAT")
+    args = parser.parse_args()
+
+    imported, started, rss, threads = footprint()
+    print(f"{'import':<28} {imported * 1e3:10.1f} ms")
+    print(f"{'import and read a motor':<28} {started * 1e3:10.1f} ms")
+    print(f"{'peak RSS':<28} {rss / 1024:10.1f} MB")
+    print(f"{'threads':<28} {threads:10d}")
+
+    start = time.monotonic()
+    sim = SimulatedSerial(speedup=100)
+    hat = Hat(device=sim)
+    print(f"{'startup':<28} {(time.monotonic() - start) * 1e3:10.1f} ms")
+    motor = Motor('A')
+    motor.get()
+    print(f"{'parse throughput':<28} {parse_throughput(sim, motor, args.frames):10.0f} lines/s")
+    if args.replay is not None:
+        lines = load_recording(args.replay)
+        print(f"{'replay throughput':<28} {replay_throughput(sim, lines, args.rate):10.0f} lines/s")
+    report("get() next frame", get_latency(motor, args.count), "us")
+    report("callback latency", callback_latency(sim, motor, args.count, 1000), "us")
+    report("command round trip", round_trip(hat, args.count), "us")
+    sim.close()
+
+
+if __name__ == '__main__':
+    main()
@@ -1,8 +1,10 @@
 """Test Color Sensor functionality"""
+import math
 import time
 import unittest
 
-from buildhat import ColorSensor
+from buildhat import ColorDistanceSensor, ColorSensor
+from buildhat.palette import DEFAULT_COLORS, ColorPalette
 
 
 class TestColor(unittest.TestCase):
@@ -42,6 +44,48 @@ class TestColor(unittest.TestCase):
             color.mode(5)
             self.assertEqual(len(color.get()), 4)
 
+    def test_palette(self):
+        """Test classifying colors with default and custom palettes"""
+        color = ColorSensor('A')
+        self.assertEqual(color.segment_color(250, 5, 5), "red")
+        self.assertEqual(color.segment_color(0, 0, 0), "black")
+        color.palette = [("dark", (0, 0, 0)), ("light", (255, 255, 255))]
+        self.assertIn(color.get_color(), ("dark", "light"))
+        palette = ColorPalette.from_samples({"orange": [(250, 120, 0), (240, 110, 10)], "black": [(0, 0, 0)]})
+        self.assertEqual(palette.classify(245, 115, 5), "orange")
+        color.palette = None
+        self.assertIn(color.wait_for_new_color(), [name for name, _ in palette.default().colors])
+
+    def test_palette_exact(self):
+        """Test the lookup table agrees with a search for the nearest color"""
+        def nearest(r, g, b):
+            near = ""
+            euc = math.inf
+            for name, rgb in DEFAULT_COLORS:
+                cur = math.sqrt((r - rgb[0]) ** 2 + (g - rgb[1]) ** 2 + (b - rgb[2]) ** 2)
+                if cur < euc:
+                    near = name
+                    euc = cur
+            return near
+
+        palette = ColorPalette.default()
+        for r in range(0, 256, 5):
+            for g in range(0, 256, 5):
+                for b in range(256):
+                    self.assertEqual(palette.classify(r, g, b), nearest(r, g, b))
+        self.assertEqual(palette.classify(300, -5, 2.5), nearest(300, -5, 2.5))
+
+    def test_colordistance_combi(self):
+        """Test reading distance, color and RGB from one combi mode"""
+        sensor = ColorDistanceSensor('B')
+        self.assertIs(sensor._modes, ColorDistanceSensor.COMBI_MODES)
+        sensor.mode(ColorDistanceSensor.COMBI)
+        self.assertEqual(len(sensor.get()), len(ColorDistanceSensor.COMBI))
+        self.assertIsInstance(sensor.get_distance(), int)
+        self.assertIn(sensor.get_color(), [name for name, _ in DEFAULT_COLORS])
+        self.assertEqual(len(sensor.get_color_rgb()), 3)
+        self.assertEqual(len(sensor.get()), len(ColorDistanceSensor.COMBI))
+
 
 if __name__ == '__main__':
     unittest.main()
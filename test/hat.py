@@ -1,8 +1,15 @@
 """Test hat functionality"""
 
+import os
+import tempfile
+import time
 import unittest
 
-from buildhat import Hat
+import buildhat
+from buildhat import Hat, Motor
+from buildhat.exc import BuildHATError, DeviceError
+from buildhat.serinterface import BuildHAT
+from buildhat.trace import SENT, TraceReader
 
 
 class TestHat(unittest.TestCase):
@@ -19,6 +26,69 @@ class TestHat(unittest.TestCase):
         """Test getting list of devices"""
         h = Hat()
         self.assertIsInstance(h.get(), dict)
+        self.assertEqual(h.get(refresh=True, timeout=5), h.get())
+
+    def test_firmware_version(self):
+        """Test firmware reports the version bundled with the library"""
+        h = Hat()
+        with open(os.path.join(os.path.dirname(buildhat.__file__), "data/version")) as f:
+            version = f.read().strip()
+        self.assertEqual(h.get_firmware_version(timeout=5).split()[0], version)
+
+    def test_startup_timings(self):
+        """Test startup phases are recorded"""
+        h = Hat()
+        timings = h.get_startup_timings()
+        self.assertIn("ready", timings)
+        self.assertLess(timings["ready"], 20)
+
+    def test_stats(self):
+        """Test counters are recorded"""
+        h = Hat()
+        h.get_vin()
+        stats = h.stats()
+        self.assertGreater(stats["lines_in"], 0)
+        self.assertGreater(stats["lines_out"], 0)
+        self.assertEqual(len(stats["ports"]), 4)
+        self.assertGreaterEqual(stats["query_wait"]["vin"]["count"], 1)
+
+    def test_observe(self):
+        """Test observing frames from a port"""
+        h = Hat()
+        m = Motor('A')
+        frames = []
+        h.observe('A', lambda now, data: frames.append(data))
+        m.get_position()
+        time.sleep(0.1)
+        h.observe('A', None)
+        self.assertGreater(len(frames), 0)
+        self.assertRaises(DeviceError, h.observe, 'E', None)
+
+    def test_trace(self):
+        """Test recording a binary trace"""
+        path = os.path.join(tempfile.mkdtemp(), "buildhat.trace")
+        h = Hat(trace=path)
+        self.assertRaises(BuildHATError, Hat, trace=path + ".other")
+        h.get_vin()
+        self.assertTrue(any("vin" in line for _, line in TraceReader(path).lines(SENT)))
+
+    def test_batch(self):
+        """Test batched commands are only split where they won't fit on one line"""
+        cmds = [f"port {i % 4} ; select 0 ; selrate 20\r".encode() for i in range(20)]
+        lines = BuildHAT._pack([cmds])
+        self.assertGreater(len(lines), 1)
+        for line in lines:
+            self.assertLessEqual(len(line), BuildHAT.MAX_LINE)
+        self.assertEqual(b"".join(lines).count(b"selrate"), 20)
+        lines = BuildHAT._pack([b"port 0 ; " + b"0" * 220 + b"\r", [b"port 1 ; set 0\r", b"port 2 ; set 0\r"]])
+        self.assertEqual(lines[1], b"port 1 ; set 0 ; port 2 ; set 0\r")
+
+    def test_batch_wait(self):
+        """Test waiting for the firmware within a batch raises instead of hanging"""
+        h = Hat()
+        with h.batch():
+            self.assertRaises(BuildHATError, h.get_vin)
+        self.assertIsInstance(h.get_vin(), float)
 
     def test_serial(self):
         """Test setting serial device"""
@@ -5,6 +5,7 @@ import unittest
 
 from buildhat import Matrix
 from buildhat.exc import MatrixError
+from buildhat.matrix import Animator, MatrixFrame
 
 
 class TestMatrix(unittest.TestCase):
@@ -82,6 +83,23 @@ class TestMatrix(unittest.TestCase):
         self.assertRaises(MatrixError, matrix.set_pixel, (0, 0), ("red", -1))
         self.assertRaises(MatrixError, matrix.set_pixel, (0, 0), ("red", 11))
 
+    def test_animation(self):
+        """Test showing pre-encoded frames"""
+        matrix = Matrix('A')
+        self.assertRaises(MatrixError, MatrixFrame, [[("gold", 10) for x in range(3)] for y in range(3)])
+        frames = [MatrixFrame([[(c, 10) for x in range(3)] for y in range(3)]) for c in range(1, 11)]
+        animator = Animator(20)
+        start = time.time()
+        animator.play(matrix, frames)
+        animator.wait()
+        self.assertAlmostEqual(time.time() - start, len(frames) / 20, delta=0.2)
+        self.assertFalse(animator.playing(matrix))
+        matrix.play(frames, fps=10, loop=True)
+        time.sleep(1)
+        matrix.stop_animation()
+        matrix.show(frames[0])
+        matrix.deselect()
+
 
 if __name__ == '__main__':
     unittest.main()
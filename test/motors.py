@@ -1,10 +1,12 @@
 """Test motors"""
 
+import threading
 import time
 import unittest
 
-from buildhat import Hat, Motor
-from buildhat.exc import DeviceError, MotorError
+from buildhat import CallbackPolicy, Hat, Motor, MotorGroup, MotorPair, MotorQueuePolicy, PidMode, SampleGroup
+from buildhat.exc import BuildHATError, DeviceError, MotorError
+from buildhat.filters import Deadband, Decimate
 
 
 class TestMotor(unittest.TestCase):
@@ -172,6 +174,21 @@ class TestMotor(unittest.TestCase):
         del m1
         Motor('A')
 
+    def test_del_after_callback(self):
+        """Test deleting motor once its callback has run"""
+        m1 = Motor('A')
+        m1.run_for_degrees(90)
+        del m1
+        Motor('A')
+
+    def test_hat(self):
+        """Test attaching motor to a given hat"""
+        h = Hat()
+        m1 = Motor('A', hat=h)  # noqa: F841
+        # Hats for the same device share its ports
+        self.assertRaises(DeviceError, Motor, 'A')
+        self.assertRaises(DeviceError, Motor, 'A', Hat(device="/dev/serial0"))
+
     def test_continuous_start(self):
         """Test starting motor for 5mins"""
         t = time.time() + (60 * 5)
@@ -238,6 +255,180 @@ class TestMotor(unittest.TestCase):
             diff = abs((end - start) - expected_dur)
             self.assertLess(diff, expected_dur * 0.1)
 
+    def test_cached_position(self):
+        """Test reading latest position without waiting for next frame"""
+        m = Motor('A')
+        m.interval = 100
+        m.get_position()
+        start = time.time()
+        for _ in range(1000):
+            m.get_position(fresh=False)
+        end = time.time()
+        self.assertLess(end - start, m.interval * 1e-3)
+        timestamp, data = m.sample
+        self.assertIsInstance(timestamp, float)
+        self.assertEqual(len(data), 3)
+
+    def test_capture(self):
+        """Test capturing samples into ring buffer"""
+        m = Motor('A')
+        m.interval = 10
+        block = m.capture(100)
+        self.assertEqual(len(block), 100 * 4)
+        times = block[::4]
+        self.assertTrue(all(b > a for a, b in zip(times, times[1:])))
+        m.start_capture(50)
+        time.sleep(1)
+        self.assertEqual(len(m.drain()), 50 * 4)
+        m.stop_capture()
+
+    def test_slow_callback_isolated(self):
+        """Test slow callback on one port doesn't delay another port"""
+        m1 = Motor('A')
+        m2 = Motor('B')
+
+        def slow(speed, pos, apos):
+            time.sleep(0.5)
+
+        def count(speed, pos, apos):
+            count.evt += 1
+        count.evt = 0
+        m1.set_callback_policy(CallbackPolicy.COALESCE)
+        m1.when_rotated = slow
+        m2.when_rotated = count
+        m1.start()
+        m2.start()
+        time.sleep(5)
+        m1.stop()
+        m2.stop()
+        self.assertGreater(count.evt, 0.8 * ((1 / ((m2.interval) * 1e-3)) * 5))
+        self.assertGreater(m1.callbacks_dropped, 0)
+
+    def test_motorgroup(self):
+        """Test group of motors runs together"""
+        g = MotorGroup('A', 'B')
+        m1, m2 = g.motors
+        pos1 = m1.get_position()
+        pos2 = m2.get_position()
+        g.run_for_degrees(360, [20, -20])
+        self.assertLess(abs(m1.get_position() - (pos1 + 360)), self.THRESHOLD_DISTANCE)
+        self.assertLess(abs(m2.get_position() - (pos2 - 360)), self.THRESHOLD_DISTANCE)
+        g.run_to_position(0)
+        self.assertLess(abs(m1.get_aposition()), self.THRESHOLD_DISTANCE)
+        self.assertLess(abs(m2.get_aposition()), self.THRESHOLD_DISTANCE)
+        self.assertRaises(MotorError, g.run_for_degrees, 360, [20])
+        self.assertRaises(MotorError, MotorGroup, 'C')
+
+    def test_motorpair_position(self):
+        """Test a motor pair accepts a negative speed when running to a position"""
+        pair = MotorPair('A', 'B')
+        pair.run_to_position(90, 90, -20)
+        self.assertLess(abs(pair._leftmotor.get_aposition() - 90), self.THRESHOLD_DISTANCE)
+        self.assertRaises(MotorError, pair.run_to_position, 0, 0, -101)
+
+    def test_sample_group(self):
+        """Test frames from two motors are delivered together"""
+        m1 = Motor('A')
+        m2 = Motor('B')
+        with SampleGroup(m1, m2, interval=20) as group:
+            sample = group.get(timeout=1)
+            self.assertEqual(len(sample.values), 2)
+            self.assertLessEqual(sample.spread, 0.01)
+        self.assertEqual(m1.interval, 20)
+        self.assertRaises(DeviceError, SampleGroup, m1)
+
+    def test_trajectory(self):
+        """Test running through waypoints without stopping"""
+        m = Motor('A')
+        pos = m.get_position()
+        m.run_trajectory([pos + 90, (pos + 180, 50), pos])
+        self.assertLess(abs(m.get_position() - pos), self.THRESHOLD_DISTANCE)
+        self.assertRaises(MotorError, m.run_trajectory, [(pos, 0)])
+
+    def test_pid(self):
+        """Test custom PID gains persist across moves"""
+        m = Motor('A')
+        m.set_pid(PidMode.POSITION, 6, 0, 0.2)
+        self.assertEqual(m.get_pid(PidMode.POSITION), (6, 0, 0.2, 3, 0.01))
+        m.run_for_degrees(90)
+        m.run_for_degrees(-90)
+        self.assertEqual(m.get_pid(PidMode.POSITION), (6, 0, 0.2, 3, 0.01))
+        m.reset_pid()
+        self.assertEqual(m.get_pid(PidMode.POSITION), Motor.DEFAULT_PID[PidMode.POSITION])
+        self.assertRaises(MotorError, m.set_pid, "position", 1, 0, 0)
+
+    def test_concurrent_get(self):
+        """Test concurrent readers share one data frame"""
+        m = Motor('A')
+        m.interval = 100
+        results = []
+        threads = [threading.Thread(target=lambda: results.append(m.get())) for _ in range(10)]
+        start = time.time()
+        for th in threads:
+            th.start()
+        for th in threads:
+            th.join()
+        self.assertEqual(len(results), 10)
+        self.assertLess(time.time() - start, 2 * m.interval * 1e-3)
+        m.deselect()
+        self.assertRaises(BuildHATError, m.get, timeout=0.5)
+
+    def test_filters(self):
+        """Test filtering frames before they reach the callback"""
+        m = Motor('A')
+        m.interval = 10
+        self.assertIsInstance(m.filters[0], Deadband)
+
+        def handle_motor(speed, pos, apos):
+            handle_motor.evt += 1
+        handle_motor.evt = 0
+        m.set_filters(Decimate(10))
+        m.when_rotated = handle_motor
+        m.run_for_seconds(1)
+        # About 100 frames, of which at most one in ten are passed on
+        self.assertGreater(handle_motor.evt, 0)
+        self.assertLess(handle_motor.evt, 20)
+        m.set_filters()
+        self.assertEqual(m.filters, ())
+
+    def test_queue_policy(self):
+        """Test newest non-blocking target taking effect straight away"""
+        m = Motor('A')
+        m.release = False
+        self.assertRaises(MotorError, setattr, m, "queue_policy", "preempt")
+        m.queue_policy = MotorQueuePolicy.PREEMPT
+        m.run_to_position(0, 100)
+        start = time.time()
+        for _ in range(5):
+            m.run_to_position(90, 10, blocking=False)
+            time.sleep(0.05)
+            m.run_to_position(-90, 10, blocking=False)
+            time.sleep(0.05)
+        m.run_to_position(0, 100, blocking=False)
+        m.queue_policy = MotorQueuePolicy.APPEND
+        m.run_to_position(0, 100)
+        # Queued one after another, the slow moves would take several seconds
+        self.assertLess(time.time() - start, 2)
+        self.assertLess(abs(m.get_aposition()), 10)
+
+    def test_start_after_preempt(self):
+        """Test start() runs the motor after a preempted move"""
+        m = Motor('A')
+        m.queue_policy = MotorQueuePolicy.PREEMPT
+        m.run_for_degrees(3600, 10, blocking=False)
+        time.sleep(0.5)
+        m.start(30)
+        time.sleep(1)
+        self.assertGreater(m.get_speed(), 15)
+        m.stop()
+        m.queue_policy = MotorQueuePolicy.REPLACE
+        m.run_for_seconds(5, 10, blocking=False)
+        m.run_for_seconds(5, 10, blocking=False)
+        m.start(30)
+        time.sleep(1)
+        self.assertGreater(m.get_speed(), 15)
+        m.stop()
+
 
 if __name__ == '__main__':
     unittest.main()